@@ -2,6 +2,8 @@
 #include <unistd.h>
 
 #include <cabbic/api.h>
+#include <cabbic/dump.h>
+#include <cabbic/reader.h>
 
 // Use the max. T48 VPP voltage of 25V.  This results in 22V supplied to the
 // EA pin.  The D8741 datasheet calls for 23V, but it seems to work fine, at
@@ -59,83 +61,64 @@ static uint8_t data_pins[] = {
     PIN_D0, PIN_D1, PIN_D2, PIN_D3, PIN_D4, PIN_D5, PIN_D6, PIN_D7
 };
 
-static cab_pin_mode_e addr_pin_modes[sizeof addr_pins];
-static cab_pin_mode_e data_pin_modes[8] = {
-    CAB_PMODE_Z, CAB_PMODE_Z, CAB_PMODE_Z, CAB_PMODE_Z,
-    CAB_PMODE_Z, CAB_PMODE_Z, CAB_PMODE_Z, CAB_PMODE_Z,
+// The address goes out on the data bus, and is latched when RST rises.  T0
+// high selects verify mode, in which the byte is then driven onto the bus.
+static const cab_rom_step_t init_steps[] = {
+    { CAB_ROM_DELAY, 0, 20000 },
+    { CAB_ROM_PIN_0, PIN_T0 },
+    { CAB_ROM_PIN_0, PIN_RST },
+    { CAB_ROM_DELAY, 0, 5000 },
+    { CAB_ROM_END },
+};
+
+static const cab_rom_step_t cycle_steps[] = {
+    { CAB_ROM_ADDRESS },
+    { CAB_ROM_COMMIT },
+    { CAB_ROM_PIN_1, PIN_RST },     // Latch address
+    { CAB_ROM_PIN_1, PIN_T0 },      // Verify (read) mode
+    { CAB_ROM_DELAY, 0, 1000 },
+    { CAB_ROM_RELEASE },
+    { CAB_ROM_SAMPLE },
+    { CAB_ROM_PIN_0, PIN_T0 },
+    { CAB_ROM_DELAY, 0, 1000 },
+    { CAB_ROM_PIN_0, PIN_RST },
+    { CAB_ROM_DELAY, 0, 1000 },
+    { CAB_ROM_END },
+};
+
+static const cab_rom_t rom = {
+    gnd_pins, sizeof gnd_pins, vcc_pins, sizeof vcc_pins,
+    vpp_pins, sizeof vpp_pins, VCC_VOLTAGE, VPP_VOLTAGE,
+    addr_pins, sizeof addr_pins, data_pins, sizeof data_pins,
+    ROM_SIZE, init_steps, cycle_steps,
 };
 
 cab_err_e
 app_run(int argc, char **argv)
 {
-    cab_err_e err;
-    FILE *fout;
+    cab_err_e err, close_err;
+    cab_dump_t *dump;
+    cab_dump_sums_t sums;
 
     if (argc != 2) {
         return CAB_ERR_BAD_ARGS;
     }
 
-    if ((fout = fopen(argv[1], "w")) == NULL) {
-        perror(argv[1]);
-        return CAB_ERR_FILE;
-    }
-
-    if ((err = cab_reset(gnd_pins, sizeof gnd_pins, vcc_pins, sizeof vcc_pins,
-      vpp_pins, sizeof vpp_pins, VCC_VOLTAGE, VPP_VOLTAGE)) != CAB_ERR_NONE) {
+    // The output format follows the file name (.hex, .srec or raw binary)
+    if ((err = cab_dump_open(argv[1], CAB_DUMP_AUTO, &dump)) != CAB_ERR_NONE) {
         return err;
     }
 
-    usleep(20000);
-
-    cab_io_hold_on();
-    cab_io_pin_mode(PIN_T0, CAB_PMODE_0);
-    cab_io_pin_mode(PIN_RST, CAB_PMODE_0);
-    cab_io_hold_off();
-
-    usleep(5000);
-
-    for (int addr = 0; addr < ROM_SIZE; addr++) {
-        // Assert address
-        for (int bit = 0; bit < sizeof addr_pins; bit++) {
-            addr_pin_modes[bit] =
-              (addr & (1<<bit)) ? CAB_PMODE_1 : CAB_PMODE_0;
-        }
-        if ((err = cab_io_pin_modes(addr_pins,
-          addr_pin_modes, sizeof addr_pins)) != CAB_ERR_NONE) {
-            return err;
-        }
-
-        cab_io_hold_on();
-        cab_io_pin_mode(PIN_RST, CAB_PMODE_1);  // Latch address
-        cab_io_pin_mode(PIN_T0, CAB_PMODE_1);   // Verify (read) mode
-        cab_io_hold_off();
-
-        usleep(1000);
-
-        // Set data pins to input and read them
-        cab_io_hold_on();
-        if ((err = cab_io_pin_modes(data_pins,
-          data_pin_modes, sizeof data_pins)) != CAB_ERR_NONE) {
-            return err;
-        }
-
-        uint8_t input[8];
-        cab_io_read(data_pins, input, sizeof input);
-
-        cab_io_pin_mode(PIN_T0, CAB_PMODE_0);
-        usleep(1000);
-        cab_io_pin_mode(PIN_RST, CAB_PMODE_0);
-        usleep(1000);
-
-        uint8_t byte = 0;
-        for (int i = 0; i < 8; i++) {
-            byte |= (input[i] ? 1<<i : 0);
-        }
-
-        fputc(byte, fout);
+    err = cab_rom_read(&rom, cab_dump_write, dump);
+
+    close_err = cab_dump_close(dump, &sums);
+    if (err == CAB_ERR_NONE) {
+        err = close_err;
     }
 
-    fclose(fout);
+    if (err == CAB_ERR_NONE) {
+        cab_dump_sums_print(&sums, stdout);
+    }
 
-    return CAB_ERR_NONE;
+    return err;
 }
@@ -4,6 +4,8 @@
 #include <unistd.h>
 
 #include <cabbic/api.h>
+#include <cabbic/dump.h>
+#include <cabbic/reader.h>
 
 #define T48_NPINS   40
 #define ROM_NPINS   24
@@ -16,6 +18,9 @@
 #define VCC_VOLTAGE     5.0
 #define ROM_SIZE        8192
 
+// Chip enable access time (tCE), rounded up
+#define ROM_TCE_US      1
+
 #define PIN_CE  MP(20)
 
 static uint8_t vcc_pins[] = { 
@@ -34,68 +39,64 @@ static uint8_t data_pins[] = {
     MP(9), MP(10), MP(11), MP(13), MP(14), MP(15), MP(16), MP(17)
 };
 
-static cab_pin_mode_e addr_pin_modes[sizeof addr_pins];
-static cab_pin_mode_e data_pin_modes[8];
+static const cab_rom_step_t init_steps[] = {
+    { CAB_ROM_RELEASE },
+    { CAB_ROM_PIN_1, PIN_CE },
+    { CAB_ROM_END },
+};
+
+// Set up the address, then pull CE low and give the ROM its access time
+// before sampling the data and releasing CE again.
+static const cab_rom_step_t cycle_steps[] = {
+    { CAB_ROM_ADDRESS },
+    { CAB_ROM_DELAY, 0, 100 },
+    { CAB_ROM_PIN_0, PIN_CE },
+    { CAB_ROM_DELAY, 0, ROM_TCE_US },
+    { CAB_ROM_SAMPLE },
+    { CAB_ROM_PIN_1, PIN_CE },
+    { CAB_ROM_END },
+};
+
+// The access time is well under a vector period, so with CE held low, the
+// data can be sampled in the same vector which drives the next address.
+static const cab_rom_step_t stream_steps[] = {
+    { CAB_ROM_PIN_0, PIN_CE },
+    { CAB_ROM_END },
+};
+
+static const cab_rom_t rom = {
+    gnd_pins, sizeof gnd_pins, vcc_pins, sizeof vcc_pins, NULL, 0,
+    VCC_VOLTAGE, 0,
+    addr_pins, sizeof addr_pins, data_pins, sizeof data_pins,
+    ROM_SIZE, init_steps, cycle_steps, stream_steps,
+};
 
 cab_err_e
 app_run(int argc, char **argv)
 {
-    cab_err_e err;
-    FILE *fout;
+    cab_err_e err, close_err;
+    cab_dump_t *dump;
+    cab_dump_sums_t sums;
 
     if (argc != 2) {
         return CAB_ERR_BAD_ARGS;
     }
 
-    if ((fout = fopen(argv[1], "w")) == NULL) {
-        perror(argv[1]);
-        return CAB_ERR_FILE;
-    }
-
-    if ((err = cab_reset(gnd_pins, sizeof gnd_pins,
-      vcc_pins, sizeof vcc_pins, NULL, 0, VCC_VOLTAGE, 0)) != CAB_ERR_NONE) {
+    // The output format follows the file name (.hex, .srec or raw binary)
+    if ((err = cab_dump_open(argv[1], CAB_DUMP_AUTO, &dump)) != CAB_ERR_NONE) {
         return err;
     }
 
-    for (int i = 0; i < 8; i++) {
-        data_pin_modes[i] = CAB_PMODE_Z;
-    }
-    if ((err = cab_io_pin_modes(data_pins,
-      data_pin_modes, sizeof data_pins)) != CAB_ERR_NONE) {
-        return err;
-    }
-
-    cab_io_pin_mode(PIN_CE, CAB_PMODE_1);
-
-    for (int addr = 0; addr < ROM_SIZE; addr++) {
-        // Assert address
-        for (int bit = 0; bit < sizeof addr_pins; bit++) {
-            addr_pin_modes[bit] =
-              (addr & (1<<bit)) ? CAB_PMODE_1 : CAB_PMODE_0;
-        }
-        if ((err = cab_io_pin_modes(addr_pins,
-          addr_pin_modes, sizeof addr_pins)) != CAB_ERR_NONE) {
-            return err;
-        }
-
-        usleep(100);
+    err = cab_rom_read(&rom, cab_dump_write, dump);
 
-        cab_io_pin_mode(PIN_CE, CAB_PMODE_0);
-
-        uint8_t input[8];
-        cab_io_read(data_pins, input, sizeof input);
-
-        cab_io_pin_mode(PIN_CE, CAB_PMODE_1);
-
-        uint8_t byte = 0;
-        for (int i = 0; i < 8; i++) {
-            byte |= (input[i] ? 1<<i : 0);
-        }
-
-        fputc(byte, fout);
+    close_err = cab_dump_close(dump, &sums);
+    if (err == CAB_ERR_NONE) {
+        err = close_err;
     }
 
-    fclose(fout);
+    if (err == CAB_ERR_NONE) {
+        cab_dump_sums_print(&sums, stdout);
+    }
 
-    return CAB_ERR_NONE;
+    return err;
 }
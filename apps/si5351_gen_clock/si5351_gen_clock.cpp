@@ -19,19 +19,43 @@ static uint8_t gnd_pins[] = {
     PIN_GND
 };
 
+// Check that a sweep loaded from a file is the one asked for
+static bool
+sweep_matches(const Si5351Sweep *sweep, uint64_t start, uint64_t stop,
+  uint64_t step)
+{
+    uint64_t steps;
+
+    if (step == 0 || stop < start) {
+        return false;
+    }
+    steps = (stop - start) / step + 1;
+
+    return sweep->clk == SI5351_CLK0 && sweep->steps == steps &&
+      sweep->freq[0] == start &&
+      sweep->freq[steps - 1] == start + (steps - 1) * step;
+}
+
 extern "C" cab_err_e
 app_run(int argc, char **argv)
 {
     cab_err_e err;
     Si5351 si;
-    unsigned clock_freq_hz;
+    Si5351Sweep sweep;
+    uint64_t freq, stop, step;
+    bool loaded = false;
 
-    if (argc != 2) {
-        printf("Usage: %s <clock0_freq_in_hz>\n", argv[0]);
+    // Frequencies are in units of 0.01 Hz, as taken by Si5351::set_freq()
+    if (argc != 2 && argc != 5 && argc != 6) {
+        printf("Usage: %s <clock0_freq_in_0.01hz>\n", argv[0]);
+        printf("       %s <start_0.01hz> <stop_0.01hz> <step_0.01hz> "
+          "<dwell_us> [table_file]\n", argv[0]);
         return CAB_ERR_BAD_ARGS;
     }
 
-    clock_freq_hz = strtol(argv[1], NULL, 0);
+    freq = strtoull(argv[1], NULL, 0);
+    stop = argc > 2 ? strtoull(argv[2], NULL, 0) : 0;
+    step = argc > 3 ? strtoull(argv[3], NULL, 0) : 0;
 
     if ((err = cab_reset(gnd_pins, sizeof gnd_pins,
       vcc_pins, sizeof vcc_pins, NULL, 0, VCC_VOLTAGE, 0)) != CAB_ERR_NONE) {
@@ -43,7 +67,42 @@ app_run(int argc, char **argv)
         return CAB_ERR_IO;
     }
 
-    si.set_freq(clock_freq_hz, SI5351_CLK0);
+    if (argc == 2) {
+        si.set_freq(freq, SI5351_CLK0);
+        return CAB_ERR_NONE;
+    }
+
+    // Sweep, using the table in 'table_file' if it's for the same sweep, or
+    // else working it out (and saving it there for next time)
+    if (argc == 6 && access(argv[5], R_OK) == 0) {
+        if (!si5351_sweep_load(&sweep, argv[5])) {
+            return CAB_ERR_FILE;
+        }
+        if (sweep_matches(&sweep, freq, stop, step)) {
+            loaded = true;
+        } else {
+            fprintf(stderr, "%s holds a different sweep, so it will be "
+              "rebuilt\n", argv[5]);
+            si5351_sweep_free(&sweep);
+        }
+    }
+
+    if (!loaded) {
+        if (!si.sweep_build_range(&sweep, freq, stop, step, SI5351_CLK0)) {
+            fprintf(stderr, "Failed to build the sweep\n");
+            return CAB_ERR_BAD_ARGS;
+        }
+        if (argc == 6 && !si5351_sweep_save(&sweep, argv[5])) {
+            si5351_sweep_free(&sweep);
+            return CAB_ERR_FILE;
+        }
+    }
+
+    if (si.sweep_play(&sweep, strtoul(argv[4], NULL, 0)) != 0) {
+        err = CAB_ERR_IO;
+    }
+
+    si5351_sweep_free(&sweep);
 
-    return CAB_ERR_NONE;
+    return err;
 }
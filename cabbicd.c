@@ -0,0 +1,542 @@
+// cabbicd: keeps a T48 open on behalf of apps using the "daemon" transport.
+//
+//  cabbicd [-s socket] [-t usb|sim]
+//
+// Apps connect over a Unix socket (see cabbic/cabbicd.h) and send the same
+// messages they would otherwise send to the T48.  The daemon answers the
+// startup query from a cache, and tracks each client's power configuration
+// (the RESET_PINS and SET_*_PINS messages it has sent), only applying it to
+// the device when it differs from what's already in effect.  Since an app
+// usually configures power the same way every time it runs, repeated runs
+// skip the reset and power-up entirely.
+//
+// Several clients may be connected at once, but the device is given to the
+// first client to use it for the whole of its session, and other clients'
+// requests for it are left queued until that client disconnects or releases
+// it.  The exception is a client whose power configuration is identical to
+// the owner's, as it can't disturb the owner: such clients share the device
+// with it, and are served round-robin, one message per client at a time.
+//
+// Client sockets are non-blocking, and replies are buffered until the client
+// reads them, so that one slow client can't hold up the others.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <cabbic/cabbicd.h>
+#include <cabbic/t48.h>
+#include <cabbic/transport.h>
+
+#define MAX_CLIENTS     16
+
+// Distinct power messages making up a configuration, and their maximum size
+#define POWER_MAX       8
+#define POWER_MSG_MAX   48
+
+// Replies buffered for a client which isn't reading them
+#define REPLY_MAX       (sizeof (cabbicd_reply_t) + CABBICD_MSG_MAX)
+#define OUTBUF_MAX      (4 * REPLY_MAX)
+
+typedef struct {
+    uint8_t msg[POWER_MSG_MAX];
+    int len;
+} power_msg_t;
+
+// The power messages sent since the last RESET_PINS.  A later message of the
+// same kind (e.g. VPP voltage) replaces an earlier one.
+typedef struct {
+    power_msg_t msgs[POWER_MAX];
+    int nmsgs;
+} power_config_t;
+
+typedef struct {
+    int fd;             // -1 if this entry is free
+    uint8_t buf[sizeof (cabbicd_request_t) + CABBICD_MSG_MAX];
+    int buflen;
+    uint8_t outbuf[OUTBUF_MAX];
+    int outlen;
+    power_config_t config;
+    bool configured;    // The client has sent any power messages
+    bool reset;         // It has sent RESET_PINS since its config was applied
+    bool synced;        // Its config has been applied at least once
+    bool dirty[POWER_MAX];
+} client_t;
+
+static const cab_transport_ops_t *transports[] = {
+    &cab_t48_usb_transport,
+    &cab_t48_sim_transport,
+};
+
+static cab_transport_t *transport;
+static client_t clients[MAX_CLIENTS];
+static uint8_t query_reply[T48_QUERY_REPLY];
+static int query_len;
+
+// Configuration currently in effect on the device, and the client it came
+// from (NULL if that client has gone).
+static power_config_t applied;
+static client_t *applied_owner;
+
+// The client which most recently sent a power message (NULL if it has gone)
+static client_t *last_configurer;
+static unsigned long power_applied, power_skipped;
+
+// The client the device has been given to (NULL if nobody has it)
+static client_t *owner;
+
+static volatile sig_atomic_t stopping;
+
+static int
+exchange(uint8_t *out, int outl, uint8_t *in, int inl)
+{
+    cab_xfer_t xfer;
+
+    memset(&xfer, 0, sizeof xfer);
+    xfer.out = out;
+    xfer.outl = outl;
+    xfer.in = in;
+    xfer.inl = inl;
+
+    transport->ops->submit(transport, &xfer);
+    transport->ops->wait(transport, &xfer);
+    if (transport->ops->release != NULL) {
+        transport->ops->release(transport, &xfer);
+    }
+
+    return xfer.actual_inl;
+}
+
+static bool
+is_power_msg(uint8_t cmd)
+{
+    return cmd == T48_SET_VCC_PINS || cmd == T48_SET_VPP_PINS ||
+      cmd == T48_SET_GND_PINS;
+}
+
+// Find the message of the same kind as 'msg' in 'config', or -1
+static int
+config_find(power_config_t *config, uint8_t *msg)
+{
+    for (int i = 0; i < config->nmsgs; i++) {
+        if (config->msgs[i].msg[0] == msg[0] &&
+          config->msgs[i].msg[1] == msg[1]) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool
+config_update(client_t *c, uint8_t *msg, int len)
+{
+    int i = config_find(&c->config, msg);
+
+    if (len > POWER_MSG_MAX) {
+        return false;
+    }
+
+    if (i < 0) {
+        if (c->config.nmsgs == POWER_MAX) {
+            return false;
+        }
+        i = c->config.nmsgs++;
+    }
+
+    memcpy(c->config.msgs[i].msg, msg, len);
+    c->config.msgs[i].len = len;
+    c->dirty[i] = true;
+    c->configured = true;
+
+    return true;
+}
+
+static bool
+config_equal(power_config_t *a, power_config_t *b)
+{
+    if (a->nmsgs != b->nmsgs) {
+        return false;
+    }
+
+    for (int i = 0; i < a->nmsgs; i++) {
+        int j = config_find(b, a->msgs[i].msg);
+        if (j < 0 || a->msgs[i].len != b->msgs[j].len ||
+          memcmp(a->msgs[i].msg, b->msgs[j].msg, a->msgs[i].len) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Make sure the client's power configuration is in effect
+static void
+power_sync(client_t *c)
+{
+    if (!c->configured) {
+        return;
+    }
+
+    if (applied_owner == c && !c->reset) {
+        // Only changes made since the configuration was applied
+        for (int i = 0; i < c->config.nmsgs; i++) {
+            if (c->dirty[i]) {
+                exchange(c->config.msgs[i].msg, c->config.msgs[i].len,
+                  NULL, 0);
+            }
+        }
+    } else if (applied_owner != c && config_equal(&c->config, &applied)) {
+        // Another client's identical configuration is already in effect.
+        // The owner asking for a reset always gets one, as it may be
+        // relying on it to release pins or cycle the power.
+        power_skipped++;
+    } else {
+        uint8_t msg[10];
+
+        memset(msg, 0, sizeof msg);
+        msg[0] = T48_RESET_PINS;
+        exchange(msg, sizeof msg, NULL, 0);
+
+        for (int i = 0; i < c->config.nmsgs; i++) {
+            exchange(c->config.msgs[i].msg, c->config.msgs[i].len, NULL, 0);
+        }
+        power_applied++;
+    }
+
+    applied = c->config;
+    applied_owner = c;
+    c->reset = false;
+    c->synced = true;
+    memset(c->dirty, 0, sizeof c->dirty);
+}
+
+// Whether the client may use the device now, giving it the device if nobody
+// has it.  A client sharing it mustn't ask for a reset, which would disturb
+// the owner.
+static bool
+device_claim(client_t *c)
+{
+    if (owner == NULL) {
+        owner = c;
+    }
+
+    return owner == c || (!c->reset && c->configured == owner->configured &&
+      config_equal(&c->config, &owner->config));
+}
+
+// Send as much of the client's buffered output as it will take
+static void
+client_flush(client_t *c)
+{
+    ssize_t n = 0;
+    int sent = 0;
+
+    // If the client has gone, the error will show up when we next read
+    while (sent < c->outlen && (n = send(c->fd, c->outbuf + sent,
+      c->outlen - sent, MSG_NOSIGNAL | MSG_DONTWAIT)) > 0) {
+        sent += n;
+    }
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        sent = c->outlen;
+    }
+
+    c->outlen -= sent;
+    memmove(c->outbuf, c->outbuf + sent, c->outlen);
+}
+
+static void
+client_close(client_t *c)
+{
+    // An app may just set up power and exit, so apply what it asked for,
+    // unless anyone else has configured or taken over the device since
+    if (!c->synced && last_configurer == c && applied_owner == NULL &&
+      (owner == NULL || owner == c)) {
+        power_sync(c);
+    }
+
+    if (applied_owner == c) {
+        applied_owner = NULL;
+    }
+    if (last_configurer == c) {
+        last_configurer = NULL;
+    }
+    if (owner == c) {
+        owner = NULL;
+    }
+
+    client_flush(c);
+    close(c->fd);
+    c->fd = -1;
+}
+
+// Queue a reply.  The caller makes sure there's room for it.
+static void
+client_reply(client_t *c, uint8_t *in, int inl, int status)
+{
+    cabbicd_reply_t reply = { inl, status };
+
+    memcpy(c->outbuf + c->outlen, &reply, sizeof reply);
+    memcpy(c->outbuf + c->outlen + sizeof reply, in, inl);
+    c->outlen += sizeof reply + inl;
+
+    client_flush(c);
+}
+
+// Serve the client's next request, if a whole one has arrived and can be
+// served now.  Returns false if not.
+static bool
+client_serve(client_t *c)
+{
+    cabbicd_request_t req;
+    uint8_t in[CABBICD_MSG_MAX];
+    uint8_t *out;
+    int len, inl = 0;
+    bool device;
+
+    // Wait for the client to read its replies before sending it more
+    if (c->buflen < (int)sizeof req || OUTBUF_MAX - c->outlen < REPLY_MAX) {
+        return false;
+    }
+
+    memcpy(&req, c->buf, sizeof req);
+    if (req.outl > CABBICD_MSG_MAX || req.inl > CABBICD_MSG_MAX) {
+        client_reply(c, NULL, 0, 1);
+        client_close(c);
+        return false;
+    }
+
+    len = sizeof req + req.outl;
+    if (c->buflen < len) {
+        return false;
+    }
+    out = c->buf + sizeof req;
+
+    // The query is answered from the cache, and power messages are only
+    // recorded until they're needed
+    device = req.outl == 0 ? req.inl > 0 : out[0] != T48_CMD_QUERY &&
+      out[0] != T48_RESET_PINS && !is_power_msg(out[0]);
+    if (device && !device_claim(c)) {
+        return false;
+    }
+
+    if (req.outl == 0 && req.inl == 0) {
+        if (owner == c) {
+            owner = NULL;
+        }
+    } else if (req.outl == 0) {
+        inl = exchange(NULL, 0, in, req.inl);
+    } else if (out[0] == T48_CMD_QUERY) {
+        inl = req.inl < query_len ? req.inl : query_len;
+        memcpy(in, query_reply, inl);
+    } else if (out[0] == T48_RESET_PINS) {
+        c->config.nmsgs = 0;
+        c->configured = true;
+        c->reset = true;
+        last_configurer = c;
+    } else if (is_power_msg(out[0])) {
+        if (!config_update(c, out, req.outl)) {
+            client_reply(c, NULL, 0, 1);
+            client_close(c);
+            return false;
+        }
+        last_configurer = c;
+    } else {
+        power_sync(c);
+        inl = exchange(out, req.outl, in, req.inl);
+    }
+
+    client_reply(c, in, inl, 0);
+
+    c->buflen -= len;
+    memmove(c->buf, c->buf + len, c->buflen);
+
+    return true;
+}
+
+static void
+on_signal(int sig)
+{
+    stopping = 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = CABBICD_SOCKET;
+    const cab_transport_ops_t *ops = transports[0];
+    char *serial = NULL;
+    struct sockaddr_un addr;
+    struct pollfd fds[1 + MAX_CLIENTS];
+    int listener, opt, next = 0;
+    uint8_t msg[5];
+
+    while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+        switch (opt) {
+            case 's':
+                path = optarg;
+                break;
+            case 't':
+                // A particular T48 may be named as e.g. "usb:1234ABCD"
+                if ((serial = strchr(optarg, ':')) != NULL) {
+                    *serial++ = '\0';
+                }
+                ops = NULL;
+                for (int i = 0; i < sizeof transports / sizeof *transports;
+                  i++) {
+                    if (strcmp(optarg, transports[i]->name) == 0) {
+                        ops = transports[i];
+                    }
+                }
+                if (ops == NULL) {
+                    fprintf(stderr, "Unknown transport '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                fprintf(stderr,
+                  "Usage: %s [-s socket] [-t usb|sim[:serial]]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((transport = ops->open(serial)) == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    memset(msg, 0, sizeof msg);
+    msg[0] = T48_CMD_QUERY;
+    query_len = exchange(msg, sizeof msg, query_reply, sizeof query_reply);
+    if (query_len < 7 || query_reply[6] != T48_DEVTYPE) {
+        fprintf(stderr,
+          "This software was written for device type 7 (T48)... exiting\n");
+        return EXIT_FAILURE;
+    }
+
+    unlink(path);
+    if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      bind(listener, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+      listen(listener, MAX_CLIENTS) < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+
+    fprintf(stderr, "cabbicd: serving T48 (%s) on %s\n", ops->name, path);
+
+    while (!stopping) {
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            fds[1+i].fd = clients[i].fd;
+            // A client waiting for the device may fill its buffer
+            fds[1+i].events =
+              (clients[i].buflen < sizeof clients[i].buf ? POLLIN : 0) |
+              (clients[i].outlen > 0 ? POLLOUT : 0);
+        }
+
+        if (poll(fds, 1 + MAX_CLIENTS, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll()");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL), i;
+
+            if (fd >= 0 && fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+                close(fd);
+                fd = -1;
+            }
+            for (i = 0; fd >= 0 && i < MAX_CLIENTS; i++) {
+                if (clients[i].fd < 0) {
+                    memset(&clients[i], 0, sizeof clients[i]);
+                    clients[i].fd = fd;
+                    break;
+                }
+            }
+            if (fd >= 0 && i == MAX_CLIENTS) {
+                close(fd);
+            }
+        }
+
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            client_t *c = &clients[i];
+            ssize_t n;
+
+            if (c->fd < 0 || fds[1+i].fd != c->fd) {
+                continue;
+            }
+
+            if (fds[1+i].revents & POLLOUT) {
+                client_flush(c);
+            }
+            if (!(fds[1+i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            if (c->buflen == sizeof c->buf) {
+                client_close(c);
+                continue;
+            }
+
+            n = recv(c->fd, c->buf + c->buflen, sizeof c->buf - c->buflen, 0);
+            if (n > 0) {
+                c->buflen += n;
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                client_close(c);
+            }
+        }
+
+        // Round-robin over the clients, one request each per pass, starting
+        // after the client which went first last time.
+        for (bool served = true; served; ) {
+            served = false;
+            for (int k = 0; k < MAX_CLIENTS; k++) {
+                client_t *c = &clients[(next + k) % MAX_CLIENTS];
+                if (c->fd >= 0 && client_serve(c)) {
+                    served = true;
+                }
+            }
+            next = (next + 1) % MAX_CLIENTS;
+        }
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) {
+            client_close(&clients[i]);
+        }
+    }
+
+    fprintf(stderr, "cabbicd: power configuration applied %lu times, "
+      "already in effect %lu times\n", power_applied, power_skipped);
+
+    close(listener);
+    unlink(path);
+    transport->ops->close(transport);
+
+    return EXIT_SUCCESS;
+}
@@ -14,6 +14,11 @@ typedef struct {
     void (*requestFrom)(unsigned i2c_addr, unsigned quantity);
     unsigned (*available)();
     unsigned (*read)();
+
+    // Whether byte 'index' (counting from 0, after the address) of the last
+    // transmission was ACKed.  Transmissions are only sent once
+    // endTransmission() is called, so this is only meaningful afterwards.
+    bool (*byteAcked)(unsigned index);
 } i2c_wire;
 
 extern i2c_wire Wire;
@@ -25,8 +25,16 @@ typedef enum {
     CAB_ERR_BAD_ARGS        = 6,
     CAB_ERR_FILE            = 7,
     CAB_ERR_IO              = 8,
+    CAB_ERR_NO_MEMORY       = 9,
 } cab_err_e;
 
+// Handle for the result of a read queued with cab_io_read_async()
+typedef uint32_t cab_ticket_t;
+
+// A T48's serial number, as a NUL terminated string
+#define CAB_SERIAL_MAX      25
+typedef char cab_serial_t[CAB_SERIAL_MAX];
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -72,6 +80,10 @@ cab_err_e cab_io_pin_mode(uint8_t pin, cab_pin_mode_e mode);
 // since the last call to cab_io_hold_on().
 cab_err_e cab_io_hold_off();
 
+// Pin changes which leave every pin as it was are not sent to the device.
+// Returns the number of such changes which have been skipped so far.
+unsigned long cab_io_commits_skipped();
+
 // Commit any outstanding pin mode changes, read all pins, and return a set of
 // readout results.
 //
@@ -80,6 +92,184 @@ cab_err_e cab_io_hold_off();
 //           from the corresponding pins (values will be either 0 or 1).
 cab_err_e cab_io_read(uint8_t *pins, uint8_t *values, int npins);
 
+// Change the modes of 'nset' pins and read 'nread' pins in the same vector, so
+// that e.g. a clock edge and the sample it produces travel in one transfer.
+// Equivalent to cab_io_hold_on(), cab_io_pin_modes() and cab_io_read(), and
+// like cab_io_read(), doesn't wait for the values within a batch.
+cab_err_e cab_io_set_and_read(uint8_t *set_pins, cab_pin_mode_e *modes,
+  int nset, uint8_t *read_pins, uint8_t *values, int nread);
+
+// Non-blocking equivalent of cab_io_read().  The read is queued along with
+// any outstanding pin changes, and a ticket is returned which can be passed
+// to cab_io_collect() later on to obtain the values.  Queued reads are sent
+// together with the pin changes which follow them, so a loop which sets up
+// an address and then reads the data for it need not wait for each result.
+//
+// pins:     Array of length 'npins' (at most 40) specifying the pins to be
+//           read.  The array is copied, so needn't remain valid.
+// ticket:   Returns the ticket for this read.
+cab_err_e cab_io_read_async(uint8_t *pins, int npins, cab_ticket_t *ticket);
+
+// Return the values for a read queued by cab_io_read_async(), waiting for
+// the read to complete if necessary.  Tickets remain valid, and can be
+// collected any number of times, until cab_io_tickets_release() is called.
+cab_err_e cab_io_collect(cab_ticket_t ticket, uint8_t *values);
+
+// Complete all queued reads and discard their tickets.
+cab_err_e cab_io_tickets_release();
+
+// Port access: the 40 IO pins as a bitmask, where bit n corresponds to pin
+// n+1.  Pins 41-56 can't be used for IO, so bits 40 and above must be zero.
+//
+// Set every pin in 'mask' to the given mode.
+cab_err_e cab_io_port_mode(uint64_t mask, cab_pin_mode_e mode);
+
+// Drive every pin in 'mask' high or low, according to the corresponding bit
+// in 'values' (i.e. CAB_PMODE_1 or CAB_PMODE_0).  Pins outside 'mask' are
+// unaffected.  Like cab_io_pin_*(), this is subject to cab_io_hold_on().
+cab_err_e cab_io_port_write(uint64_t mask, uint64_t values);
+
+// Commit any outstanding pin changes, and read all 40 pins.  Unlike
+// cab_io_read(), this always waits for the result, even within a batch.
+cab_err_e cab_io_port_read(uint64_t *values);
+
+// Deferred equivalents of cab_io_port_read(), which work in the same way as
+// cab_io_read_async() and cab_io_collect().
+cab_err_e cab_io_port_read_async(cab_ticket_t *ticket);
+cab_err_e cab_io_port_collect(cab_ticket_t ticket, uint64_t *values);
+
+// Batch pin updates and reads into as few USB transactions as possible.
+// Between cab_io_batch_begin() and cab_io_batch_end(), each commit of pin
+// state (a call to cab_io_pin_*() without a hold, cab_io_hold_off() or
+// cab_io_read()) is appended as a vector to a multi-vector message, rather
+// than being sent immediately.  The T48 applies the vectors in order, and
+// returns the pin values sampled by each one.
+//
+// cab_io_read() does not wait for results during a batch: the 'pins' and
+// 'values' arrays passed to it must remain valid until cab_io_batch_flush()
+// or cab_io_batch_end() has returned, after which 'values' will be filled in.
+// Batches may be nested, in which case only the outermost cab_io_batch_end()
+// flushes.
+cab_err_e cab_io_batch_begin();
+cab_err_e cab_io_batch_flush();
+cab_err_e cab_io_batch_end();
+
+// Set the number of USB messages which may be in flight at once (1-16, with
+// a default of 1).  With a depth greater than 1, a pin change which doesn't
+// read anything back returns as soon as its message has been queued, so that
+// the next message can be prepared while the previous one is still in
+// transit.  Errors such as overcurrent are then reported by a later call.
+// Replies are always processed in order.  cab_io_batch_flush() waits for all
+// queued messages to complete.
+cab_err_e cab_set_queue_depth(int depth);
+
+// Hand all USB traffic over to a dedicated I/O thread, which the app thread
+// communicates with via lock-free queues.  Combined with a queue depth
+// greater than 1, this lets the app carry on computing (or writing files)
+// while transfers are in progress.  The API itself must still only be called
+// from one thread.
+cab_err_e cab_io_thread_start();
+cab_err_e cab_io_thread_stop();
+
+// Equivalent to usleep(), except that the time is accounted as sleep rather
+// than compute in the statistics (see cabbic/stats.h).
+void cab_usleep(unsigned long usec);
+
+// Wait until at least 'usec' microseconds have passed since the pins were
+// last changed, e.g. to meet a setup or hold time.  The time is counted from
+// when the change reached the T48 (taken to be halfway through the USB round
+// trip), so time already spent on the way back counts towards the delay, and
+// only whatever remains is spent sleeping.  Changes held by cab_io_hold_on()
+// are not committed.
+//
+// Within a batch, if the time the T48 takes to apply a vector is known (see
+// cab_io_vector_period()), short delays are made by repeating the last vector
+// instead, so the batch doesn't have to be flushed.
+cab_err_e cab_delay_at_least(unsigned long usec);
+
+// Set the minimum time, in nanoseconds, that the T48 takes to apply one
+// vector, for use by cab_delay_at_least().  The default is taken from
+// CABBIC_VECTOR_NS if set, and is otherwise 0, meaning unknown, in which case
+// delays are always made by the host.
+cab_err_e cab_io_vector_period(unsigned long ns);
+
+// Return the vector period set by cab_io_vector_period(), or 0 if unknown.
+unsigned long cab_io_vector_period_get();
+
+// Keep the pins as they are for another 'n' vectors, by repeating the last
+// one, e.g. to meet a minimum time between changes with a number of vectors
+// worked out from the vector period.  Changes held by cab_io_hold_on() are
+// committed first.  Within a batch the repeats are just queued, so unlike
+// cab_delay_at_least(), this never waits for the device.
+cab_err_e cab_io_repeat(unsigned n);
+
+// Contexts.  Each T48 in use is driven through its own context, and the
+// functions above act on a default context, which is opened before app_run()
+// is called.  Each function above has an equivalent below which takes the
+// context explicitly.  A context must only be used by one thread at a time,
+// but different contexts may be used by different threads concurrently.
+typedef struct cab_ctx cab_ctx_t;
+
+// Open a context using the named transport (see CABBIC_TRANSPORT), or, if
+// 'transport' is NULL, the transport the app was started with.  A serial
+// number may follow the transport name after a colon (e.g. "usb:1234ABCD")
+// to pick a particular T48; otherwise the first one not already in use by
+// this process is opened.
+cab_err_e cab_ctx_open(const char *transport, cab_ctx_t **ctx);
+cab_err_e cab_ctx_open_serial(const char *transport, const char *serial,
+  cab_ctx_t **ctx);
+void cab_ctx_close(cab_ctx_t *ctx);
+cab_ctx_t *cab_ctx_default();
+const char *cab_ctx_serial(cab_ctx_t *ctx);
+
+// List the serial numbers of up to 'max' T48s attached via 'transport' (or the
+// app's transport, if NULL), including any already open.  '*count' is set to
+// the number found, which may exceed 'max'.  Fails with CAB_ERR_STATE if the
+// transport can't tell (e.g. the daemon transport, which has only one T48).
+cab_err_e cab_enumerate(const char *transport, cab_serial_t *serials, int max,
+  int *count);
+
+cab_err_e cab_ctx_io_thread_start(cab_ctx_t *ctx);
+cab_err_e cab_ctx_io_thread_stop(cab_ctx_t *ctx);
+cab_err_e cab_ctx_set_io_voltage(cab_ctx_t *ctx, float voltage);
+cab_err_e cab_ctx_reset(cab_ctx_t *ctx, uint8_t *gnd_pins, int ngnd,
+  uint8_t *vcc_pins, int nvcc, uint8_t *vpp_pins, int nvpp, float vcc_voltage,
+  float vpp_voltage);
+cab_err_e cab_ctx_set_vpp_voltage(cab_ctx_t *ctx, float voltage);
+cab_err_e cab_ctx_io_pullup(cab_ctx_t *ctx, bool enabled);
+cab_err_e cab_ctx_io_batch_begin(cab_ctx_t *ctx);
+cab_err_e cab_ctx_io_batch_flush(cab_ctx_t *ctx);
+cab_err_e cab_ctx_set_queue_depth(cab_ctx_t *ctx, int depth);
+cab_err_e cab_ctx_io_batch_end(cab_ctx_t *ctx);
+cab_err_e cab_ctx_io_hold_on(cab_ctx_t *ctx);
+cab_err_e cab_ctx_io_hold_off(cab_ctx_t *ctx);
+cab_err_e cab_ctx_io_pin_modes(cab_ctx_t *ctx, uint8_t *pins,
+  cab_pin_mode_e *modes, int npins);
+cab_err_e cab_ctx_io_pin_mode(cab_ctx_t *ctx, uint8_t pin, cab_pin_mode_e mode);
+cab_err_e cab_ctx_io_read(cab_ctx_t *ctx, uint8_t *pins, uint8_t *values,
+  int npins);
+cab_err_e cab_ctx_io_set_and_read(cab_ctx_t *ctx, uint8_t *set_pins,
+  cab_pin_mode_e *modes, int nset, uint8_t *read_pins, uint8_t *values,
+  int nread);
+cab_err_e cab_ctx_io_port_mode(cab_ctx_t *ctx, uint64_t mask,
+  cab_pin_mode_e mode);
+cab_err_e cab_ctx_io_port_write(cab_ctx_t *ctx, uint64_t mask, uint64_t values);
+cab_err_e cab_ctx_io_port_read(cab_ctx_t *ctx, uint64_t *values);
+unsigned long cab_ctx_io_commits_skipped(cab_ctx_t *ctx);
+cab_err_e cab_ctx_io_read_async(cab_ctx_t *ctx, uint8_t *pins, int npins,
+  cab_ticket_t *ticket);
+cab_err_e cab_ctx_io_port_read_async(cab_ctx_t *ctx, cab_ticket_t *ticket);
+cab_err_e cab_ctx_io_collect(cab_ctx_t *ctx, cab_ticket_t ticket,
+  uint8_t *values);
+cab_err_e cab_ctx_io_port_collect(cab_ctx_t *ctx, cab_ticket_t ticket,
+  uint64_t *values);
+cab_err_e cab_ctx_io_tickets_release(cab_ctx_t *ctx);
+void cab_ctx_usleep(cab_ctx_t *ctx, unsigned long usec);
+cab_err_e cab_ctx_delay_at_least(cab_ctx_t *ctx, unsigned long usec);
+cab_err_e cab_ctx_io_vector_period(cab_ctx_t *ctx, unsigned long ns);
+unsigned long cab_ctx_io_vector_period_get(cab_ctx_t *ctx);
+cab_err_e cab_ctx_io_repeat(cab_ctx_t *ctx, unsigned n);
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cabbic/api.h>
+
+// A bus is a named group of IO pins which carries a single value, such as
+// the address or data lines of a memory device.  The pins are validated, and
+// the mapping between bus values and pin states is worked out, when the bus
+// is created, so that reading and writing a bus costs no more than a call to
+// cab_io_port_*().
+
+typedef struct cab_bus cab_bus_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Create a bus from 'npins' (at most 40) IO pins.  pins[0] carries the least
+// significant bit of the bus value.
+// The bus is driven through the default context, or through 'ctx' when
+// created with cab_ctx_bus_create().
+cab_err_e cab_bus_create(uint8_t *pins, int npins, cab_bus_t **bus);
+cab_err_e cab_ctx_bus_create(cab_ctx_t *ctx, uint8_t *pins, int npins,
+  cab_bus_t **bus);
+
+void cab_bus_free(cab_bus_t *bus);
+
+// Returns the mask of port bits (see cab_io_port_*()) used by the bus.
+uint64_t cab_bus_mask(cab_bus_t *bus);
+
+// Drive the bus pins with the given value.  Subject to cab_io_hold_on().
+cab_err_e cab_bus_write(cab_bus_t *bus, uint64_t value);
+
+// Configure the bus pins as inputs.  Subject to cab_io_hold_on().
+cab_err_e cab_bus_input(cab_bus_t *bus);
+
+// Commit any outstanding pin changes, and read the value on the bus.
+cab_err_e cab_bus_read(cab_bus_t *bus, uint64_t *value);
+
+// Deferred equivalents of cab_bus_read(), which work in the same way as
+// cab_io_read_async() and cab_io_collect().
+cab_err_e cab_bus_read_async(cab_bus_t *bus, cab_ticket_t *ticket);
+cab_err_e cab_bus_collect(cab_bus_t *bus, cab_ticket_t ticket,
+  uint64_t *value);
+
+// Convert between bus values and port bitmasks.
+uint64_t cab_bus_to_port(cab_bus_t *bus, uint64_t value);
+uint64_t cab_bus_from_port(cab_bus_t *bus, uint64_t port);
+
+#ifdef __cplusplus
+};
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+// Protocol spoken between cabbicd and the "daemon" transport, over a Unix
+// stream socket.  Each T48 message is sent as a request header followed by
+// 'outl' bytes of message, and is answered by a reply header followed by
+// 'inl' bytes of reply.  Requests are answered in order, so a client may send
+// several before reading any replies.  A request with neither message nor
+// reply releases the device, if the client has it, for other clients whose
+// power configuration differs; otherwise it's released when the client
+// disconnects.  Both ends are on the same host, so native byte order is used.
+
+#define CABBICD_SOCKET      "/tmp/cabbicd.sock"
+
+// Largest message or reply which can be carried
+#define CABBICD_MSG_MAX     1024
+
+typedef struct {
+    uint16_t outl;
+    uint16_t inl;       // Size of the reply expected from the T48
+} cabbicd_request_t;
+
+typedef struct {
+    uint16_t inl;       // Number of bytes of reply which follow
+    uint16_t status;    // Nonzero if the request was malformed
+} cabbicd_reply_t;
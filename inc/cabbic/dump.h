@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <cabbic/api.h>
+
+// Output stage for data read from a device.  Data is gathered into large
+// buffers, which a background thread formats, checksums and writes out, so
+// that reading never waits for the file system or for hashing.  A CRC-32 and
+// a SHA-256 digest of the data are computed as it goes.
+
+typedef enum {
+    CAB_DUMP_AUTO,      // Chosen from the file name (.hex, .srec/.s19/.mot)
+    CAB_DUMP_RAW,       // Binary, in the order written
+    CAB_DUMP_IHEX,      // Intel HEX
+    CAB_DUMP_SREC,      // Motorola S-record
+} cab_dump_format_e;
+
+#define CAB_DUMP_SHA256_BYTES   32
+
+typedef struct {
+    uint64_t bytes;
+    uint32_t crc32;
+    uint8_t sha256[CAB_DUMP_SHA256_BYTES];
+} cab_dump_sums_t;
+
+typedef struct cab_dump cab_dump_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+cab_err_e cab_dump_open(const char *path, cab_dump_format_e format,
+  cab_dump_t **dump);
+
+// Append 'len' bytes which were read from address 'addr'.  The data is copied,
+// so needn't remain valid.  Errors from writing earlier data are reported
+// here, or by cab_dump_close().  The arguments match cab_rom_sink_fn (see
+// reader.h), with the dump as 'arg'.
+cab_err_e cab_dump_write(void *dump, uint32_t addr, const uint8_t *data,
+  size_t len);
+
+// Write out anything remaining and close the file.  If 'sums' is not NULL, it
+// receives the size and checksums of everything written.
+cab_err_e cab_dump_close(cab_dump_t *dump, cab_dump_sums_t *sums);
+
+// Print the size and checksums to 'f'
+void cab_dump_sums_print(const cab_dump_sums_t *sums, FILE *f);
+
+#ifdef __cplusplus
+};
+#endif
@@ -2,14 +2,49 @@
 
 #include <stdint.h>
 
+#include <cabbic/api.h>
+
+// One step of an I2C transaction
+typedef enum {
+    CABBIC_I2C_START,   // Start, or repeated start, condition
+    CABBIC_I2C_STOP,    // Stop condition
+    CABBIC_I2C_WRITE,   // Send 'data'; 'ack' is set to 0 if it was ACKed
+    CABBIC_I2C_READ,    // Receive 'data', then send an ACK, or a NACK if 'ack'
+} cabbic_i2c_op_e;
+
+typedef struct {
+    cabbic_i2c_op_e op;
+    uint8_t data;
+    uint8_t ack;
+} cabbic_i2c_step_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Run 'nsteps' steps as a single batch, filling in the data received by each
+// read step and the ACK status of each write step.
+cab_err_e cabbic_i2c_transfer(cabbic_i2c_step_t *steps, int nsteps);
+
+// Single steps, each of which is sent on its own.  cabbic_i2c_write_byte()
+// returns 0 if the byte was ACKed.
 void cabbic_i2c_start();
 void cabbic_i2c_stop();
 uint8_t cabbic_i2c_write_byte(uint8_t data);
 uint8_t cabbic_i2c_read_byte(uint8_t ack);
+
+// Block transfers, each as a single transaction.  Register reads write the
+// register number and then read with a repeated start, and both directions
+// rely on the device incrementing the register number after each byte.  All
+// fail with CAB_ERR_IO if the device doesn't ACK.
+cab_err_e cabbic_i2c_read_bytes(uint8_t i2c_addr, uint8_t *buf, int n);
+cab_err_e cabbic_i2c_read_registers(uint8_t i2c_addr, uint8_t reg,
+  uint8_t *buf, int n);
+cab_err_e cabbic_i2c_write_registers(uint8_t i2c_addr, uint8_t reg,
+  const uint8_t *buf, int n);
+
+// Single register access.  A read from a device which doesn't respond
+// returns 0xff.
 void cabbic_i2c_write_register(uint8_t i2c_addr, uint8_t reg, uint8_t val);
 uint8_t cabbic_i2c_read_register(uint8_t i2c_addr, uint8_t reg);
 
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <cabbic/api.h>
+
+// Generic reader for parallel ROMs and EPROMs.  A chip is described by its
+// power pins, address and data pins, and the steps needed to read each
+// location, and the reader takes care of running those steps as quickly as
+// possible: the whole read is done as one batch, with several messages in
+// flight, and results are collected and passed on in large chunks.
+//
+// Each run of consecutive pin steps is applied as a single vector, so steps
+// which can happen at the same time should be listed together.  A vector is
+// committed at each CAB_ROM_COMMIT, CAB_ROM_DELAY and CAB_ROM_SAMPLE step,
+// and at the end of each cycle.  Delays are made with cab_delay_at_least(),
+// so they only stay within the batch if the T48's vector period is known
+// (see CABBIC_VECTOR_NS).
+
+typedef enum {
+    CAB_ROM_END,        // Marks the end of a list of steps
+    CAB_ROM_ADDRESS,    // Drive the address pins with the current address
+    CAB_ROM_RELEASE,    // Make the data pins inputs (e.g. on a shared bus)
+    CAB_ROM_PIN_0,      // Drive 'pin' low
+    CAB_ROM_PIN_1,      // Drive 'pin' high
+    CAB_ROM_COMMIT,     // Apply the steps so far before any which follow
+    CAB_ROM_DELAY,      // Commit, and wait at least 'us' microseconds
+    CAB_ROM_SAMPLE,     // Commit, and read the data pins in the same vector
+} cab_rom_op_e;
+
+typedef struct {
+    cab_rom_op_e op;
+    uint8_t pin;
+    unsigned long us;
+} cab_rom_step_t;
+
+typedef struct {
+    uint8_t *gnd_pins;
+    int ngnd;
+    uint8_t *vcc_pins;
+    int nvcc;
+    uint8_t *vpp_pins;
+    int nvpp;
+    float vcc_voltage;
+    float vpp_voltage;
+
+    // addr_pins[0] and data_pins[0] are the least significant bits.  At most
+    // 8 data pins are supported, and each location is read as a byte.
+    uint8_t *addr_pins;
+    int naddr;
+    uint8_t *data_pins;
+    int ndata;
+
+    uint32_t size;                  // Number of locations
+    const cab_rom_step_t *init;     // Run once after power-up (may be NULL)
+    const cab_rom_step_t *cycle;    // Run for each location
+
+    // Opt-in overlapped reads.  If not NULL, these steps are run after 'init'
+    // to put the chip in a state where its data pins simply follow the
+    // address pins (e.g. with CE held low), after which each vector drives
+    // one address and samples the data for it or for the one before.  The
+    // cycle's delays aren't used, so the chip's access time must be shorter
+    // than a vector period.  The results are checked against ordinary reads
+    // first, and overlapped reads are only used if they match.
+    const cab_rom_step_t *stream;
+} cab_rom_t;
+
+// Receives 'len' bytes read from the chip, starting at address 'addr'.  The
+// data is passed on in order.
+typedef cab_err_e (*cab_rom_sink_fn)(void *arg, uint32_t addr,
+  const uint8_t *data, size_t len);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Power up the chip and read the whole of it.  This resets the T48, and
+// leaves the queue depth set to the reader's own choice.
+cab_err_e cab_rom_read(const cab_rom_t *rom, cab_rom_sink_fn sink, void *arg);
+cab_err_e cab_ctx_rom_read(cab_ctx_t *ctx, const cab_rom_t *rom,
+  cab_rom_sink_fn sink, void *arg);
+
+// A sink which writes to the stdio stream 'arg'
+cab_err_e cab_rom_sink_file(void *arg, uint32_t addr, const uint8_t *data,
+  size_t len);
+
+#ifdef __cplusplus
+};
+#endif
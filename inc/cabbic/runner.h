@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cabbic/api.h>
+
+// The job runner shares a list of independent jobs (e.g. one per chip in a
+// tray) between all the T48s attached via the app's transport.  Each T48 gets
+// a worker thread and its own context, and each worker takes the next job
+// from the list as soon as it has finished the last one, so throughput grows
+// with the number of programmers, and faster ones simply do more jobs.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Called once for each T48 before it runs any jobs, e.g. to power it up with
+// cab_ctx_reset().  A T48 which can't be opened (e.g. because it has been
+// unplugged since it was enumerated) or whose setup fails doesn't run any
+// jobs.
+typedef cab_err_e (*cab_setup_fn)(cab_ctx_t *ctx, void *arg);
+
+// Carries out job number 'job', using 'ctx'.
+typedef cab_err_e (*cab_job_fn)(cab_ctx_t *ctx, int job, void *arg);
+
+// Run jobs 0 to njobs - 1, and return once they have all finished.  The
+// default context is used as one of the workers.  'setup' may be NULL, and
+// 'results', if not NULL, receives the result of each job.  Returns the
+// result of the first job which failed, or of the setup of the first T48
+// which failed if that left no workers.
+cab_err_e cab_run_jobs(int njobs, cab_setup_fn setup, cab_job_fn job,
+  void *arg, cab_err_e *results);
+
+#ifdef __cplusplus
+};
+#endif
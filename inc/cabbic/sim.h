@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+// The software T48 (selected with CABBIC_TRANSPORT=sim) can have a simulated
+// device attached to its IO pins.  For each vector, the device function is
+// passed the set of pins being driven by the T48 and the levels they are
+// being driven to (as port bitmasks, see cab_io_port_*()), and returns the
+// levels on all pins.  Only the levels of pins which aren't being driven are
+// used.  Without a device, undriven pins read as 0, or 1 if the pullups are
+// enabled.
+//
+// CABBIC_SIM_DEVICES sets how many software T48s appear to be attached (one by
+// default).  They all share the device function, which is called from
+// whichever thread is driving each of them.
+
+typedef uint64_t (*cab_sim_device_fn)(void *arg,
+  uint64_t driven, uint64_t levels);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void cab_sim_attach(cab_sim_device_fn device, void *arg);
+
+#ifdef __cplusplus
+};
+#endif
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <cabbic/api.h>
+
+// Instrumentation collected by the core while an app runs.  Setting the
+// CABBIC_STATS environment variable prints a summary to stderr on exit.
+
+// Messages sent to the T48, by command
+typedef enum {
+    CAB_STATS_CMD_QUERY,
+    CAB_STATS_CMD_CONFIG_AND_READ,
+    CAB_STATS_CMD_RESET_PINS,
+    CAB_STATS_CMD_SET_VCC_PINS,
+    CAB_STATS_CMD_SET_VPP_PINS,
+    CAB_STATS_CMD_SET_GND_PINS,
+    CAB_STATS_CMD_OTHER,
+    CAB_STATS_NCMDS,
+} cab_stats_cmd_e;
+
+// API calls which can cause messages to be sent.  Each message is charged
+// to the call which sent it, so e.g. a message sent by cab_io_batch_end()
+// counts against CAB_STATS_API_BATCH, even though it carries vectors from
+// earlier calls.  Messages sent by the core itself count against
+// CAB_STATS_API_CORE.
+typedef enum {
+    CAB_STATS_API_CORE,
+    CAB_STATS_API_RESET,        // cab_reset()
+    CAB_STATS_API_SET_VOLTAGE,  // cab_set_*_voltage()
+    CAB_STATS_API_PIN_MODE,     // cab_io_pin_mode(), cab_io_pin_modes()
+    CAB_STATS_API_HOLD_OFF,     // cab_io_hold_off()
+    CAB_STATS_API_READ,         // cab_io_read()
+    CAB_STATS_API_READ_ASYNC,   // cab_io_read_async(), cab_io_port_read_async()
+    CAB_STATS_API_COLLECT,      // cab_io_*collect(), cab_io_tickets_release()
+    CAB_STATS_API_PORT_MODE,    // cab_io_port_mode()
+    CAB_STATS_API_PORT_WRITE,   // cab_io_port_write()
+    CAB_STATS_API_PORT_READ,    // cab_io_port_read()
+    CAB_STATS_API_BATCH,        // cab_io_batch_*(), cab_set_queue_depth(), etc.
+    CAB_STATS_API_DELAY,        // cab_delay_at_least(), cab_io_repeat()
+    CAB_STATS_API_SET_AND_READ, // cab_io_set_and_read()
+    CAB_STATS_NAPIS,
+} cab_stats_api_e;
+
+// Latencies are kept in a log-linear histogram, with 16 buckets for each
+// power of two, giving a resolution of about 6% at any scale.
+#define CAB_STATS_SUB_BITS  4
+#define CAB_STATS_BUCKETS   (45 << CAB_STATS_SUB_BITS)
+
+// All times are in nanoseconds
+typedef struct {
+    struct {
+        uint64_t messages;
+        uint64_t vectors;
+        uint64_t bytes_out;
+        uint64_t bytes_in;
+    } cmd[CAB_STATS_NCMDS];
+
+    struct {
+        uint64_t calls;
+        uint64_t messages;
+    } api[CAB_STATS_NAPIS];
+
+    // Time from each message's submission until its reply was processed
+    uint64_t latency_count;
+    uint64_t latency_min;
+    uint64_t latency_max;
+    uint64_t latency_total;
+    uint64_t latency[CAB_STATS_BUCKETS];
+
+    // Where the time went since startup.  'compute' is whatever wasn't spent
+    // waiting for the T48 or sleeping in cab_usleep() or cab_delay_at_least().
+    uint64_t wall;
+    uint64_t usb_wait;
+    uint64_t sleep;
+    uint64_t compute;
+} cab_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Statistics are kept for each context.  These act on the default context.
+void cab_stats_get(cab_stats_t *stats);
+void cab_stats_reset();
+
+void cab_ctx_stats_get(cab_ctx_t *ctx, cab_stats_t *stats);
+void cab_ctx_stats_reset(cab_ctx_t *ctx);
+
+// Return the latency below which 'percentile' percent of messages completed
+uint64_t cab_stats_percentile(const cab_stats_t *stats, double percentile);
+
+void cab_stats_print(const cab_stats_t *stats, FILE *f);
+
+#ifdef __cplusplus
+};
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+
+// T48 protocol definitions, shared by the core and the transports.
+
+#define T48_USB_VID 0xA466
+#define T48_USB_PID 0x0A53
+#define T48_DEVTYPE 7
+
+// 40 ZIF pins plus 16 on front-facing jumper connector
+#define T48_MAX_PINS        56
+
+#define T48_CMD_QUERY       0x00
+#define T48_CONFIG_AND_READ 0x28
+#define T48_RESET_PINS      0x2D
+#define T48_SET_VCC_PINS    0x2E
+#define T48_SET_VPP_PINS    0x2F
+#define T48_SET_GND_PINS    0x30
+
+// Each T48_CONFIG_AND_READ vector carries a 4-bit mode for each of the 40
+// IO pins, and the reply carries the readback values in the same layout.
+// Several vectors can be packed back to back into one message, which the
+// T48 applies in order; we keep the message within a single bulk packet.
+#define T48_VECTOR_PINS     40
+#define T48_VECTOR_BYTES    (T48_VECTOR_PINS / 2)
+#define T48_MAX_VECTORS     24
+#define T48_VECTOR_MSG_MAX  (8 + T48_MAX_VECTORS * T48_VECTOR_BYTES)
+
+// Size of the reply to T48_CMD_QUERY, and where the serial number sits in it
+#define T48_QUERY_REPLY     80
+#define T48_SERIAL_OFFSET   32
+#define T48_SERIAL_LEN      24
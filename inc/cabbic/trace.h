@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Timeline tracing.  Setting the CABBIC_TRACE environment variable to a file
+// name records spans for each USB exchange, each public cab_*() call, the
+// I2C layer and anything the app marks up itself, and writes them out on
+// exit in the Chrome trace-event JSON format (which can be loaded into
+// chrome://tracing or https://ui.perfetto.dev).
+//
+// Each thread records into its own buffer, so tracing doesn't take any locks.
+// Category and span names must be string literals (or otherwise outlive the
+// run), since only the pointers are recorded.
+
+typedef struct {
+    uint64_t start;     // 0 if tracing is off
+    const char *cat;
+    const char *name;
+} cab_trace_span_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool cab_trace_enabled();
+
+cab_trace_span_t cab_trace_begin(const char *cat, const char *name);
+void cab_trace_end(cab_trace_span_t *span);
+
+// Like cab_trace_end(), but attach a named value to the span
+void cab_trace_end_arg(cab_trace_span_t *span, const char *arg, long value);
+
+#ifdef __cplusplus
+};
+#endif
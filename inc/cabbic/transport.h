@@ -0,0 +1,62 @@
+#pragma once
+
+// Transports carry T48 messages between the core and a programmer.  The core
+// picks one at startup (see CABBIC_TRANSPORT in main.c), and drives it through
+// the operations below.  A transport which can't continue once open (e.g.
+// because the device has gone away) reports the problem and exits.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <cabbic/api.h>
+
+typedef struct cab_transport cab_transport_t;
+
+// One message exchange: 'outl' bytes are sent from 'out', after which up to
+// 'inl' bytes are received into 'in'.  Either length may be zero.
+typedef struct {
+    uint8_t *out;
+    int outl;
+    uint8_t *in;
+    int inl;
+    int actual_inl;
+    int done;           // Set once the exchange is complete
+
+    // For use by the transport
+    int pending;
+    void *priv[2];
+} cab_xfer_t;
+
+typedef struct {
+    const char *name;
+
+    // Open the programmer with the given serial number, or if 'serial' is
+    // NULL, the first one which isn't already open in this process.  Returns
+    // NULL if there's no such programmer, or it can't be opened.
+    cab_transport_t *(*open)(const char *serial);
+    void (*close)(cab_transport_t *tp);
+
+    // Start an exchange.  Exchanges complete in the order they're submitted.
+    void (*submit)(cab_transport_t *tp, cab_xfer_t *xfer);
+
+    // Wait for the oldest outstanding exchange, 'xfer', to complete.
+    void (*wait)(cab_transport_t *tp, cab_xfer_t *xfer);
+
+    // Fill in the serial numbers of up to 'max' attached programmers, and
+    // return how many there are.  NULL if the transport can't enumerate.
+    int (*enumerate)(cab_serial_t *serials, int max);
+
+    // Free whatever the transport has kept in 'xfer', which is no longer
+    // in use.  Called for each exchange before close().  NULL if the
+    // transport keeps nothing there.
+    void (*release)(cab_transport_t *tp, cab_xfer_t *xfer);
+} cab_transport_ops_t;
+
+// Transports extend this with their own state
+struct cab_transport {
+    const cab_transport_ops_t *ops;
+};
+
+extern const cab_transport_ops_t cab_t48_usb_transport;
+extern const cab_transport_ops_t cab_t48_sim_transport;
+extern const cab_transport_ops_t cab_t48_daemon_transport;
@@ -187,6 +187,13 @@
 #define SI5351_XTAL_ENABLE              (1<<6)
 #define SI5351_MULTISYNTH_ENABLE        (1<<4)
 
+/* Number of registers held in the register shadow (0 to FANOUT_ENABLE) */
+#define SI5351_REGISTERS                188
+
+/* Runs of up to this many unchanged registers are rewritten by commit(), to
+ * join up the changed registers on either side into one transfer */
+#define SI5351_COMMIT_GAP               2
+
 
 /* Macro definitions */
 
@@ -276,6 +283,31 @@ struct Si5351IntStatus
 	uint8_t LOS_STKY;
 };
 
+/*
+ * A precomputed frequency sweep (see Si5351::sweep_build()).  Step 0 sets
+ * every register the sweep touches, and each later step holds only the
+ * registers which differ from the step before.  A step is a series of runs,
+ * each of which is a register number, a count and that many values.  The
+ * frequency of the clock's PLL after each step is kept too, since set_freq()
+ * may change it.
+ */
+struct Si5351Sweep
+{
+	enum si5351_clock clk;
+	enum si5351_pll pll;
+	uint32_t steps;
+	uint64_t *freq;
+	uint64_t *pll_freq;
+	uint32_t *start;	/* steps + 1 offsets of each step within data */
+	uint8_t *data;
+	uint32_t size;
+	uint32_t alloc;
+};
+
+void si5351_sweep_free(struct Si5351Sweep *);
+bool si5351_sweep_save(const struct Si5351Sweep *, const char *);
+bool si5351_sweep_load(struct Si5351Sweep *, const char *);
+
 class Si5351
 {
 public:
@@ -306,6 +338,13 @@ public:
 	uint8_t si5351_write_bulk(uint8_t, uint8_t, uint8_t *);
 	uint8_t si5351_write(uint8_t, uint8_t);
 	uint8_t si5351_read(uint8_t);
+	bool load_registers(void);
+	void stage(void);
+	uint8_t commit(void);
+	bool sweep_build(struct Si5351Sweep *, const uint64_t *, uint32_t, enum si5351_clock);
+	bool sweep_build_range(struct Si5351Sweep *, uint64_t, uint64_t, uint64_t, enum si5351_clock);
+	uint8_t sweep_step(const struct Si5351Sweep *, uint32_t);
+	uint8_t sweep_play(const struct Si5351Sweep *, unsigned long);
 	struct Si5351Status dev_status = {.SYS_INIT = 0, .LOL_B = 0, .LOL_A = 0,
     .LOS = 0, .REVID = 0};
 	struct Si5351IntStatus dev_int_status = {.SYS_INIT_STKY = 0, .LOL_B_STKY = 0,
@@ -324,12 +363,23 @@ private:
 	void update_sys_status(struct Si5351Status *);
 	void update_int_status(struct Si5351IntStatus *);
 	void ms_div(enum si5351_clock, uint8_t, uint8_t);
+	uint8_t set_freq_regs(uint64_t, enum si5351_clock);
+	int commit_phase(uint8_t, uint8_t);
 	uint8_t select_r_div(uint64_t *);
 	uint8_t select_r_div_ms67(uint64_t *);
 	int32_t ref_correction[2];
   uint8_t clkin_div;
   uint8_t i2c_bus_addr;
   bool clk_first_set[8];
+  bool reg_volatile(uint8_t);
+  uint8_t reg_shadow[SI5351_REGISTERS];
+  bool reg_known[SI5351_REGISTERS];
+  bool reg_dirty[SI5351_REGISTERS];
+  uint8_t reg_before[SI5351_REGISTERS];
+  int stage_depth;
+  struct Si5351Sweep *record;
+  bool record_failed;
+  bool *reg_touched;
 };
 
 #endif /* SI5351_H_ */
@@ -1,11 +1,19 @@
 #include <stdint.h>
 
 #include <cabbic/i2c.h>
+#include <cabbic/trace.h>
 #include <Wire.h>
 
+// A transmission is queued until endTransmission(), and then sent as a
+// single transaction: the steps are the start, the address, one write per
+// byte queued, and the stop.
+#define TX_MAX      256
+
 static int i2c_error = 0;
 static int bytes_available = 0, read_ptr = 0;
 static uint8_t read_buffer[256];
+static cabbic_i2c_step_t tx_steps[TX_MAX + 3];
+static int tx_len;
 
 // "Wire" interface callbacks
 static void
@@ -18,31 +26,56 @@ i2c_begin_transmission(unsigned i2c_addr)
 {
     i2c_error = I2C_ERROR_NONE;
 
-    cabbic_i2c_start();
-
-    uint8_t ack = cabbic_i2c_write_byte(i2c_addr << 1);
-
-    if (ack) {
-        i2c_error = I2C_ERROR_ADDR_NACK;
-    }
+    tx_steps[0] = (cabbic_i2c_step_t){ CABBIC_I2C_START };
+    tx_steps[1] = (cabbic_i2c_step_t){ CABBIC_I2C_WRITE,
+      (uint8_t)(i2c_addr << 1), 1 };
+    tx_len = 0;
 }
 
 unsigned
 i2c_end_transmission()
 {
-    cabbic_i2c_stop();
+    cab_trace_span_t span = cab_trace_begin("wire", "endTransmission");
+    int nsteps = 2 + tx_len;
+
+    tx_steps[nsteps++] = (cabbic_i2c_step_t){ CABBIC_I2C_STOP };
+
+    if (i2c_error == I2C_ERROR_NONE) {
+        if (cabbic_i2c_transfer(tx_steps, nsteps) != CAB_ERR_NONE) {
+            i2c_error = I2C_ERROR_OTHER;
+        } else if (tx_steps[1].ack) {
+            i2c_error = I2C_ERROR_ADDR_NACK;
+        } else {
+            for (int i = 0; i < tx_len; i++) {
+                if (tx_steps[2 + i].ack) {
+                    i2c_error = I2C_ERROR_DATA_NACK;
+                    break;
+                }
+            }
+        }
+    }
+
+    cab_trace_end_arg(&span, "bytes", tx_len);
 
     return i2c_error;
 }
 
+bool
+i2c_byte_acked(unsigned index)
+{
+    return index < (unsigned)tx_len && !tx_steps[2 + index].ack;
+}
+
 void
 i2c_write(unsigned value)
 {
-    uint8_t ack = cabbic_i2c_write_byte(value);
-
-    if (ack) {
-        i2c_error = I2C_ERROR_DATA_NACK;
+    if (tx_len == TX_MAX) {
+        i2c_error = I2C_ERROR_TOO_LONG;
+        return;
     }
+
+    tx_steps[2 + tx_len++] = (cabbic_i2c_step_t){ CABBIC_I2C_WRITE,
+      (uint8_t)value, 1 };
 }
 
 void
@@ -53,20 +86,21 @@ i2c_request_from(unsigned i2c_addr, unsigned quantity)
         return;
     }
 
-    i2c_error = I2C_ERROR_NONE;
-
-    cabbic_i2c_start();
+    cab_trace_span_t span = cab_trace_begin("wire", "requestFrom");
 
-    cabbic_i2c_write_byte(i2c_addr<<1 | 1);
+    i2c_error = I2C_ERROR_NONE;
 
-    for (unsigned i = 0; i < quantity; i++) {
-        read_buffer[i] = cabbic_i2c_read_byte(i == quantity-1 ? 1 : 0);
+    // The whole read is a single transaction
+    if (cabbic_i2c_read_bytes(i2c_addr, read_buffer,
+      quantity) == CAB_ERR_NONE) {
+        bytes_available = quantity;
+    } else {
+        i2c_error = I2C_ERROR_ADDR_NACK;
+        bytes_available = 0;
     }
-
-    cabbic_i2c_stop();
-
-    bytes_available = quantity;
     read_ptr = 0;
+
+    cab_trace_end_arg(&span, "quantity", quantity);
 }
 
 unsigned
@@ -93,5 +127,6 @@ i2c_wire Wire = {
     i2c_write,
     i2c_request_from,
     i2c_available,
-    i2c_read
+    i2c_read,
+    i2c_byte_acked
 };
@@ -0,0 +1,192 @@
+// Pin buses, built on top of the port API.
+//
+// Values are converted to and from port bitmasks a byte at a time, using
+// tables built when the bus is created: to_port[k][b] holds the port bits
+// for byte k of a bus value being equal to b, and from_port[k][b] holds the
+// bus value bits for byte k of the port being equal to b.  A 40-pin bus
+// therefore needs at most 5 lookups in each direction.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cabbic/api.h>
+#include <cabbic/bus.h>
+
+#define PORT_PINS   40
+#define PORT_BYTES  (PORT_PINS / 8)
+
+struct cab_bus {
+    cab_ctx_t *ctx;
+    int npins;
+    int nbytes;
+    uint64_t mask;
+    uint64_t to_port[PORT_BYTES][256];
+    uint64_t from_port[PORT_BYTES][256];
+};
+
+cab_err_e
+cab_ctx_bus_create(cab_ctx_t *ctx, uint8_t *pins, int npins, cab_bus_t **bus)
+{
+    cab_bus_t *b;
+    int bus_bit[PORT_PINS];
+
+    if (pins == NULL || bus == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if (npins < 1 || npins > PORT_PINS) {
+        return CAB_ERR_OUT_OF_RANGE;
+    }
+
+    if ((b = calloc(1, sizeof *b)) == NULL) {
+        return CAB_ERR_NO_MEMORY;
+    }
+    b->ctx = ctx;
+
+    for (int i = 0; i < PORT_PINS; i++) {
+        bus_bit[i] = -1;
+    }
+
+    for (int i = 0; i < npins; i++) {
+        if (pins[i] < 1 || pins[i] > PORT_PINS) {
+            fprintf(stderr, "cab_bus_create(): Pin out of range (%d)\n",
+              pins[i]);
+            free(b);
+            return CAB_ERR_OUT_OF_RANGE;
+        }
+
+        if (bus_bit[pins[i]-1] >= 0) {
+            fprintf(stderr, "cab_bus_create(): Pin %d used twice\n", pins[i]);
+            free(b);
+            return CAB_ERR_INVALID_PARAM;
+        }
+
+        bus_bit[pins[i]-1] = i;
+        b->mask |= 1ULL << (pins[i]-1);
+    }
+
+    b->npins = npins;
+    b->nbytes = (npins + 7) / 8;
+
+    for (int k = 0; k < PORT_BYTES; k++) {
+        for (int v = 0; v < 256; v++) {
+            for (int bit = 0; bit < 8; bit++) {
+                if (!(v & (1<<bit))) {
+                    continue;
+                }
+
+                int i = 8*k + bit;
+                if (i < npins) {
+                    b->to_port[k][v] |= 1ULL << (pins[i]-1);
+                }
+                if (bus_bit[i] >= 0) {
+                    b->from_port[k][v] |= 1ULL << bus_bit[i];
+                }
+            }
+        }
+    }
+
+    *bus = b;
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_bus_create(uint8_t *pins, int npins, cab_bus_t **bus)
+{
+    return cab_ctx_bus_create(cab_ctx_default(), pins, npins, bus);
+}
+
+void
+cab_bus_free(cab_bus_t *bus)
+{
+    free(bus);
+}
+
+uint64_t
+cab_bus_mask(cab_bus_t *bus)
+{
+    return bus->mask;
+}
+
+uint64_t
+cab_bus_to_port(cab_bus_t *bus, uint64_t value)
+{
+    uint64_t port = 0;
+
+    for (int k = 0; k < bus->nbytes; k++) {
+        port |= bus->to_port[k][(value >> (8*k)) & 0xff];
+    }
+
+    return port;
+}
+
+uint64_t
+cab_bus_from_port(cab_bus_t *bus, uint64_t port)
+{
+    uint64_t value = 0;
+
+    for (int k = 0; k < PORT_BYTES; k++) {
+        value |= bus->from_port[k][(port >> (8*k)) & 0xff];
+    }
+
+    return value;
+}
+
+cab_err_e
+cab_bus_write(cab_bus_t *bus, uint64_t value)
+{
+    return cab_ctx_io_port_write(bus->ctx, bus->mask,
+      cab_bus_to_port(bus, value));
+}
+
+cab_err_e
+cab_bus_input(cab_bus_t *bus)
+{
+    return cab_ctx_io_port_mode(bus->ctx, bus->mask, CAB_PMODE_Z);
+}
+
+cab_err_e
+cab_bus_read(cab_bus_t *bus, uint64_t *value)
+{
+    uint64_t port;
+    cab_err_e err;
+
+    if (value == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if ((err = cab_ctx_io_port_read(bus->ctx, &port)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    *value = cab_bus_from_port(bus, port);
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_bus_read_async(cab_bus_t *bus, cab_ticket_t *ticket)
+{
+    return cab_ctx_io_port_read_async(bus->ctx, ticket);
+}
+
+cab_err_e
+cab_bus_collect(cab_bus_t *bus, cab_ticket_t ticket, uint64_t *value)
+{
+    uint64_t port;
+    cab_err_e err;
+
+    if (value == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    err = cab_ctx_io_port_collect(bus->ctx, ticket, &port);
+    if (err != CAB_ERR_NONE) {
+        return err;
+    }
+
+    *value = cab_bus_from_port(bus, port);
+
+    return CAB_ERR_NONE;
+}
@@ -0,0 +1,397 @@
+// Dump output stage.
+//
+// The app fills one buffer at a time, and hands each full buffer to the
+// writer thread, which checksums it, formats it and writes it out.  There are
+// DUMP_NBUFFERS buffers, so the app only has to wait if the writer falls that
+// far behind.  Each buffer holds data for a single run of addresses.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <cabbic/api.h>
+#include <cabbic/dump.h>
+#include "lib/hash.h"
+
+#define DUMP_BUFFER         (64 * 1024)
+#define DUMP_NBUFFERS       4
+
+// Data bytes per Intel HEX or S-record line
+#define DUMP_RECORD         16
+
+typedef struct {
+    uint32_t addr;
+    size_t len;
+    uint8_t data[DUMP_BUFFER];
+} dump_buf_t;
+
+struct cab_dump {
+    FILE *f;
+    cab_dump_format_e format;
+
+    // Buffers head to head + count - 1 are waiting for the writer (which
+    // removes each one only once it has finished with it), and buffer
+    // head + count is being filled by the app.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned head, count;
+    bool closing;
+    cab_err_e err;
+    dump_buf_t bufs[DUMP_NBUFFERS];
+
+    pthread_t thread;
+
+    // Used only by the writer
+    uint64_t bytes;
+    uint32_t crc;
+    sha256_t sha;
+    uint32_t ihex_upper;
+    int srec_type;
+};
+
+static cab_dump_format_e
+format_from_path(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+
+    if (ext == NULL) {
+        return CAB_DUMP_RAW;
+    }
+
+    if (strcmp(ext, ".hex") == 0 || strcmp(ext, ".ihex") == 0) {
+        return CAB_DUMP_IHEX;
+    }
+
+    if (strcmp(ext, ".srec") == 0 || strcmp(ext, ".s19") == 0 ||
+      strcmp(ext, ".s28") == 0 || strcmp(ext, ".s37") == 0 ||
+      strcmp(ext, ".mot") == 0) {
+        return CAB_DUMP_SREC;
+    }
+
+    return CAB_DUMP_RAW;
+}
+
+// Write one Intel HEX or S-record line.  'head' holds the record's count,
+// address and type fields in the byte order they're sent.
+static void
+write_record(cab_dump_t *d, char start, const uint8_t *head, int nhead,
+  const uint8_t *data, int len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char line[2 + 2 * (8 + DUMP_RECORD) + 2], *p = line;
+    uint8_t sum = 0;
+
+    *p++ = start;
+    for (int i = 0; i < nhead + len; i++) {
+        uint8_t b = i < nhead ? head[i] : data[i - nhead];
+        if (start == 'S' && i == 0) {
+            // The S-record type digit comes before the count
+            *p++ = '0' + b;
+            continue;
+        }
+        sum += b;
+        *p++ = hex[b >> 4];
+        *p++ = hex[b & 0xf];
+    }
+
+    // Intel HEX uses the two's complement of the sum, S-records the one's
+    // complement
+    sum = start == ':' ? -sum : ~sum;
+    *p++ = hex[sum >> 4];
+    *p++ = hex[sum & 0xf];
+    *p++ = '\n';
+
+    fwrite(line, 1, p - line, d->f);
+}
+
+static void
+write_ihex(cab_dump_t *d, uint32_t addr, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        // Records can't cross a 64KB boundary
+        int n = len < DUMP_RECORD ? len : DUMP_RECORD;
+        if ((addr & 0xffff) + n > 0x10000) {
+            n = 0x10000 - (addr & 0xffff);
+        }
+
+        if (addr >> 16 != d->ihex_upper) {
+            uint8_t upper[] = { 2, 0, 0, 4, addr >> 24, addr >> 16 };
+            write_record(d, ':', upper, sizeof upper, NULL, 0);
+            d->ihex_upper = addr >> 16;
+        }
+
+        uint8_t head[] = { n, addr >> 8, addr, 0 };
+        write_record(d, ':', head, sizeof head, data, n);
+
+        addr += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static void
+write_srec(cab_dump_t *d, uint32_t addr, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        int n = len < DUMP_RECORD ? len : DUMP_RECORD;
+        uint32_t end = addr + n - 1;
+
+        // S1, S2 and S3 records have 2, 3 and 4 address bytes
+        int type = end <= 0xffff ? 1 : end <= 0xffffff ? 2 : 3;
+        int nhead = 0;
+        uint8_t head[6];
+
+        head[nhead++] = type;
+        head[nhead++] = type + 1 + n + 1;
+        for (int i = type; i >= 0; i--) {
+            head[nhead++] = addr >> (8*i);
+        }
+        write_record(d, 'S', head, nhead, data, n);
+
+        if (type > d->srec_type) {
+            d->srec_type = type;
+        }
+
+        addr += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static void
+dump_header(cab_dump_t *d)
+{
+    static const uint8_t name[] = "cabbic";
+
+    if (d->format == CAB_DUMP_SREC) {
+        uint8_t head[] = { 0, 2 + sizeof name - 1 + 1, 0, 0 };
+        write_record(d, 'S', head, sizeof head, name, sizeof name - 1);
+    }
+}
+
+static void
+dump_trailer(cab_dump_t *d)
+{
+    if (d->format == CAB_DUMP_IHEX) {
+        uint8_t eof[] = { 0, 0, 0, 1 };
+        write_record(d, ':', eof, sizeof eof, NULL, 0);
+    } else if (d->format == CAB_DUMP_SREC) {
+        // The S9, S8 or S7 terminator matches the widest address used
+        int type = 10 - (d->srec_type > 0 ? d->srec_type : 1);
+        int naddr = 11 - type;
+        uint8_t head[6] = { type, naddr + 1 };
+        write_record(d, 'S', head, 2 + naddr, NULL, 0);
+    }
+}
+
+static void
+dump_buffer(cab_dump_t *d, dump_buf_t *buf)
+{
+    d->bytes += buf->len;
+    d->crc = hash_crc32(d->crc, buf->data, buf->len);
+    sha256_update(&d->sha, buf->data, buf->len);
+
+    switch (d->format) {
+        case CAB_DUMP_IHEX:
+            write_ihex(d, buf->addr, buf->data, buf->len);
+            break;
+        case CAB_DUMP_SREC:
+            write_srec(d, buf->addr, buf->data, buf->len);
+            break;
+        default:
+            fwrite(buf->data, 1, buf->len, d->f);
+            break;
+    }
+}
+
+static void *
+dump_thread_main(void *arg)
+{
+    cab_dump_t *d = arg;
+
+    pthread_mutex_lock(&d->lock);
+
+    for (;;) {
+        while (d->count == 0 && !d->closing) {
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+        if (d->count == 0) {
+            break;
+        }
+
+        // The app doesn't touch queued buffers, so no need to hold the lock
+        pthread_mutex_unlock(&d->lock);
+        dump_buffer(d, &d->bufs[d->head]);
+        bool failed = ferror(d->f);
+        pthread_mutex_lock(&d->lock);
+
+        if (failed && d->err == CAB_ERR_NONE) {
+            d->err = CAB_ERR_FILE;
+        }
+        d->head = (d->head + 1) % DUMP_NBUFFERS;
+        d->count--;
+        pthread_cond_broadcast(&d->cond);
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+cab_err_e
+cab_dump_open(const char *path, cab_dump_format_e format, cab_dump_t **dump)
+{
+    cab_dump_t *d;
+
+    if (path == NULL || dump == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if ((d = calloc(1, sizeof *d)) == NULL) {
+        return CAB_ERR_NO_MEMORY;
+    }
+
+    if ((d->f = fopen(path, "w")) == NULL) {
+        perror(path);
+        free(d);
+        return CAB_ERR_FILE;
+    }
+
+    d->format = format == CAB_DUMP_AUTO ? format_from_path(path) : format;
+    sha256_init(&d->sha);
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+
+    dump_header(d);
+
+    if (pthread_create(&d->thread, NULL, dump_thread_main, d) != 0) {
+        fprintf(stderr, "Failed to create dump thread\n");
+        fclose(d->f);
+        free(d);
+        return CAB_ERR_IO;
+    }
+
+    *dump = d;
+
+    return CAB_ERR_NONE;
+}
+
+// Hand the buffer being filled to the writer, and wait until there's another
+// free one
+static cab_err_e
+dump_submit(cab_dump_t *d)
+{
+    cab_err_e err;
+
+    pthread_mutex_lock(&d->lock);
+
+    d->count++;
+    pthread_cond_broadcast(&d->cond);
+
+    while (d->count == DUMP_NBUFFERS) {
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+    d->bufs[(d->head + d->count) % DUMP_NBUFFERS].len = 0;
+    err = d->err;
+
+    pthread_mutex_unlock(&d->lock);
+
+    return err;
+}
+
+cab_err_e
+cab_dump_write(void *dump, uint32_t addr, const uint8_t *data, size_t len)
+{
+    cab_dump_t *d = dump;
+    cab_err_e err;
+
+    if (d == NULL || (data == NULL && len > 0)) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    while (len > 0) {
+        // Only the app changes 'count' upwards, so this is safe to read
+        pthread_mutex_lock(&d->lock);
+        dump_buf_t *buf = &d->bufs[(d->head + d->count) % DUMP_NBUFFERS];
+        pthread_mutex_unlock(&d->lock);
+
+        // Each buffer holds one run of addresses
+        if (buf->len > 0 && (buf->len == DUMP_BUFFER ||
+          buf->addr + buf->len != addr)) {
+            if ((err = dump_submit(d)) != CAB_ERR_NONE) {
+                return err;
+            }
+            continue;
+        }
+
+        if (buf->len == 0) {
+            buf->addr = addr;
+        }
+
+        size_t n = DUMP_BUFFER - buf->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(&buf->data[buf->len], data, n);
+        buf->len += n;
+
+        addr += n;
+        data += n;
+        len -= n;
+    }
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_dump_close(cab_dump_t *d, cab_dump_sums_t *sums)
+{
+    cab_err_e err;
+
+    if (d == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bufs[(d->head + d->count) % DUMP_NBUFFERS].len > 0) {
+        d->count++;
+    }
+    d->closing = true;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+
+    pthread_join(d->thread, NULL);
+
+    dump_trailer(d);
+
+    err = d->err;
+    if (fclose(d->f) != 0 && err == CAB_ERR_NONE) {
+        err = CAB_ERR_FILE;
+    }
+
+    if (sums) {
+        sums->bytes = d->bytes;
+        sums->crc32 = d->crc;
+        sha256_final(&d->sha, sums->sha256);
+    }
+
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+    free(d);
+
+    return err;
+}
+
+void
+cab_dump_sums_print(const cab_dump_sums_t *sums, FILE *f)
+{
+    fprintf(f, "Size: %llu bytes\n", (unsigned long long)sums->bytes);
+    fprintf(f, "CRC32: %08x\n", sums->crc32);
+    fprintf(f, "SHA-256: ");
+    for (int i = 0; i < CAB_DUMP_SHA256_BYTES; i++) {
+        fprintf(f, "%02x", sums->sha256[i]);
+    }
+    fprintf(f, "\n");
+}
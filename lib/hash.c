@@ -0,0 +1,175 @@
+// CRC-32 and SHA-256.
+//
+// The CRC is computed eight bytes at a time ("slicing-by-8"), using eight
+// 256-entry tables: crc_table[k][b] is the CRC contribution of byte value b
+// followed by k zero bytes, so each 8-byte step is eight independent lookups
+// rather than a chain of eight dependent ones.
+
+#include <string.h>
+#include <pthread.h>
+
+#include "lib/hash.h"
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_init()
+{
+    for (int b = 0; b < 256; b++) {
+        uint32_t c = b;
+        for (int i = 0; i < 8; i++) {
+            c = (c >> 1) ^ (c & 1 ? 0xedb88320 : 0);
+        }
+        crc_table[0][b] = c;
+    }
+
+    for (int b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t c = crc_table[k - 1][b];
+            crc_table[k][b] = (c >> 8) ^ crc_table[0][c & 0xff];
+        }
+    }
+}
+
+uint32_t
+hash_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+    pthread_once(&crc_once, crc_init);
+
+    crc = ~crc;
+
+    for (; len >= 8; data += 8, len -= 8) {
+        uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 |
+          (uint32_t)data[3] << 24);
+        uint32_t hi = data[4] | data[5] << 8 | data[6] << 16 |
+          (uint32_t)data[7] << 24;
+
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+          crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+          crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+          crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xff];
+    }
+
+    return ~crc;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)   ((x) >> (n) | (x) << (32 - (n)))
+
+static void
+sha256_block(sha256_t *s, const uint8_t *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4*i] << 24 | p[4*i + 1] << 16 | p[4*i + 2] << 8 |
+          p[4*i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ w[i - 15] >> 3;
+        uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10;
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+    e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+          ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+          ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void
+sha256_init(sha256_t *s)
+{
+    static const uint32_t h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(s->h, h0, sizeof h0);
+    s->len = 0;
+    s->nblock = 0;
+}
+
+void
+sha256_update(sha256_t *s, const uint8_t *data, size_t len)
+{
+    s->len += len;
+
+    if (s->nblock > 0) {
+        size_t n = 64 - s->nblock < len ? 64 - s->nblock : len;
+        memcpy(&s->block[s->nblock], data, n);
+        s->nblock += n;
+        data += n;
+        len -= n;
+        if (s->nblock < 64) {
+            return;
+        }
+        sha256_block(s, s->block);
+        s->nblock = 0;
+    }
+
+    for (; len >= 64; data += 64, len -= 64) {
+        sha256_block(s, data);
+    }
+
+    memcpy(s->block, data, len);
+    s->nblock = len;
+}
+
+void
+sha256_final(sha256_t *s, uint8_t digest[SHA256_BYTES])
+{
+    uint64_t bits = s->len * 8;
+
+    s->block[s->nblock++] = 0x80;
+    if (s->nblock > 56) {
+        memset(&s->block[s->nblock], 0, 64 - s->nblock);
+        sha256_block(s, s->block);
+        s->nblock = 0;
+    }
+    memset(&s->block[s->nblock], 0, 56 - s->nblock);
+    for (int i = 0; i < 8; i++) {
+        s->block[56 + i] = bits >> (56 - 8*i);
+    }
+    sha256_block(s, s->block);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4*i] = s->h[i] >> 24;
+        digest[4*i + 1] = s->h[i] >> 16;
+        digest[4*i + 2] = s->h[i] >> 8;
+        digest[4*i + 3] = s->h[i];
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Checksums for dumped data
+
+// CRC-32 as used by zip and PNG (reflected, polynomial 0xEDB88320).  Start
+// with a crc of 0, and feed the result of each call into the next.
+uint32_t hash_crc32(uint32_t crc, const uint8_t *data, size_t len);
+
+#define SHA256_BYTES        32
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t block[64];
+    int nblock;
+} sha256_t;
+
+void sha256_init(sha256_t *s);
+void sha256_update(sha256_t *s, const uint8_t *data, size_t len);
+void sha256_final(sha256_t *s, uint8_t digest[SHA256_BYTES]);
@@ -4,129 +4,407 @@
 // the Makefile via the -D compiler directive.  These are the pins of the T48
 // which are connected to the Data and Clock lines, respectively, of the I2C
 // bus.
+//
+// A transaction is compiled into a single batch: each edge of SCL or change of
+// SDA is one vector, and SDA is sampled in the same vector that raises SCL for
+// each bit that is read, so a whole transaction costs a handful of messages
+// rather than a round trip per pin change.  The ACK and data bits are decoded
+// from the samples once the batch has been flushed.
+//
+// Every step leaves SCL low (except a stop, which leaves the bus idle), and
+// data is only changed while SCL is low.  The bus timing is met inside the
+// batch, by repeating each vector for as many vector periods as the state it
+// sets must last (see cab_io_repeat()).  The timing defaults to Fast-mode
+// (400 kHz), and any of the I2C_*_NS times below may be defined to change it.
+// The number of vectors is worked out from the vector period given by
+// cab_io_vector_period(), or if that isn't known, from I2C_VECTOR_NS, which
+// is deliberately short so that the times are met on any T48.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <cabbic/api.h>
 #include <cabbic/i2c.h>
+#include "trace.h"
 
-static uint8_t i2c_pins[2] = { I2C_PIN_SCL, I2C_PIN_SDA };
+#ifndef I2C_TLOW_NS
+#define I2C_TLOW_NS         1300    // SCL low
+#endif
+#ifndef I2C_THIGH_NS
+#define I2C_THIGH_NS        600     // SCL high
+#endif
+#ifndef I2C_TSU_DAT_NS
+#define I2C_TSU_DAT_NS      100     // SDA set up before SCL rises
+#endif
+#ifndef I2C_TSTART_NS
+#define I2C_TSTART_NS       600     // Set up and hold of (repeated) start/stop
+#endif
+#ifndef I2C_TBUF_NS
+#define I2C_TBUF_NS         1300    // Bus free between stop and start
+#endif
 
-// A general assumption is that the message round trip time is long enough
-// that we don't need to add delays between updating pins.
+#ifndef I2C_VECTOR_NS
+#define I2C_VECTOR_NS       250
+#endif
 
-static void
-set_i2c_pins(uint8_t scl, uint8_t sda)
+// Samples taken by a step: one per data bit, then one for the ACK bit
+#define I2C_STEP_SAMPLES    9
+
+// Transfers of up to this many steps keep their samples on the stack
+#define I2C_STACK_STEPS     32
+
+// cab_io_set_and_read() keeps a pointer to these until the batch is flushed
+static uint8_t sda_pin = I2C_PIN_SDA;
+static uint8_t scl_pin = I2C_PIN_SCL;
+static cab_pin_mode_e scl_high = CAB_PMODE_1;
+
+// Vector period used for the transfer in progress
+static unsigned long vector_ns;
+
+// Keep the pins as they are until 'ns' has passed since the last change
+static cab_err_e
+hold(unsigned long ns)
+{
+    unsigned long n = (ns + vector_ns - 1) / vector_ns;
+
+    // The vector which made the change counts as one
+    return n > 1 ? cab_io_repeat(n - 1) : CAB_ERR_NONE;
+}
+
+static cab_err_e
+drive(uint8_t pin, cab_pin_mode_e mode, unsigned long ns)
+{
+    cab_err_e err = cab_io_pin_mode(pin, mode);
+
+    return err != CAB_ERR_NONE ? err : hold(ns);
+}
+
+// Send one bit, with SCL starting and ending low
+static cab_err_e
+clock_out(uint8_t bit)
 {
     cab_err_e err;
-    cab_pin_mode_e pin_modes[2];
 
-    pin_modes[0] = (sda ? CAB_PMODE_1 : CAB_PMODE_0);
-    pin_modes[1] = (scl ? CAB_PMODE_1 : CAB_PMODE_0);
+    if ((err = drive(I2C_PIN_SDA, bit ? CAB_PMODE_1 : CAB_PMODE_0,
+      I2C_TSU_DAT_NS)) != CAB_ERR_NONE ||
+      (err = drive(I2C_PIN_SCL, CAB_PMODE_1, I2C_THIGH_NS)) != CAB_ERR_NONE) {
+        return err;
+    }
 
-    if ((err = cab_io_pin_modes(i2c_pins,
-      pin_modes, sizeof i2c_pins)) != CAB_ERR_NONE) {
-        fprintf(stderr, "set_i2c_pins(): %s\n", cab_sterror(err));
+    return drive(I2C_PIN_SCL, CAB_PMODE_0, I2C_TLOW_NS);
+}
+
+// Receive one bit into 'sample' (filled in when the batch is flushed), with
+// SDA already released.  SDA is sampled in the vector which raises SCL, by
+// which time the device has had all of tLOW to put the bit on the bus.
+static cab_err_e
+clock_in(uint8_t *sample)
+{
+    cab_err_e err;
+
+    if ((err = cab_io_set_and_read(&scl_pin, &scl_high, 1,
+      &sda_pin, sample, 1)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    if ((err = hold(I2C_THIGH_NS)) != CAB_ERR_NONE) {
+        return err;
     }
+
+    return drive(I2C_PIN_SCL, CAB_PMODE_0, I2C_TLOW_NS);
 }
 
-static void
-set_scl(uint8_t val)
+static cab_err_e
+queue_step(const cabbic_i2c_step_t *step, uint8_t *samples)
 {
-    cab_io_pin_mode(I2C_PIN_SCL, val ? CAB_PMODE_1 : CAB_PMODE_0);
+    cab_err_e err = CAB_ERR_NONE;
+
+    switch (step->op) {
+        case CABBIC_I2C_START:
+            // Also serves as a repeated start, since SCL is low between steps
+            if ((err = drive(I2C_PIN_SDA, CAB_PMODE_1,
+              I2C_TSU_DAT_NS)) != CAB_ERR_NONE ||
+              (err = drive(I2C_PIN_SCL, CAB_PMODE_1,
+              I2C_TSTART_NS)) != CAB_ERR_NONE ||
+              (err = drive(I2C_PIN_SDA, CAB_PMODE_0,
+              I2C_TSTART_NS)) != CAB_ERR_NONE) {
+                break;
+            }
+            err = drive(I2C_PIN_SCL, CAB_PMODE_0, I2C_TLOW_NS);
+            break;
+
+        case CABBIC_I2C_STOP:
+            if ((err = drive(I2C_PIN_SDA, CAB_PMODE_0,
+              I2C_TSU_DAT_NS)) != CAB_ERR_NONE ||
+              (err = drive(I2C_PIN_SCL, CAB_PMODE_1,
+              I2C_TSTART_NS)) != CAB_ERR_NONE) {
+                break;
+            }
+            err = drive(I2C_PIN_SDA, CAB_PMODE_1, I2C_TBUF_NS);
+            break;
+
+        case CABBIC_I2C_WRITE:
+            for (int i = 7; i >= 0 && err == CAB_ERR_NONE; i--) {
+                err = clock_out((step->data >> i) & 1);
+            }
+            if (err == CAB_ERR_NONE &&
+              (err = drive(I2C_PIN_SDA, CAB_PMODE_Z, 0)) == CAB_ERR_NONE) {
+                err = clock_in(&samples[8]);
+            }
+            break;
+
+        case CABBIC_I2C_READ:
+            err = drive(I2C_PIN_SDA, CAB_PMODE_Z, 0);
+            for (int i = 0; i < 8 && err == CAB_ERR_NONE; i++) {
+                err = clock_in(&samples[i]);
+            }
+            if (err == CAB_ERR_NONE) {
+                err = clock_out(step->ack);
+            }
+            break;
+
+        default:
+            err = CAB_ERR_INVALID_PARAM;
+            break;
+    }
+
+    return err;
 }
 
-static void
-set_sda(uint8_t val)
+cab_err_e
+cabbic_i2c_transfer(cabbic_i2c_step_t *steps, int nsteps)
 {
-    cab_io_pin_mode(I2C_PIN_SDA, val ? CAB_PMODE_1 : CAB_PMODE_0);
+    cab_trace_span_t span;
+    cab_err_e err, end_err;
+    uint8_t stack_samples[I2C_STACK_STEPS * I2C_STEP_SAMPLES];
+    uint8_t *samples = stack_samples;
+
+    if (steps == NULL || nsteps < 0) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if (nsteps > I2C_STACK_STEPS &&
+      (samples = malloc(nsteps * I2C_STEP_SAMPLES)) == NULL) {
+        return CAB_ERR_NO_MEMORY;
+    }
+
+    span = cab_trace_begin("i2c", __func__);
+
+    if ((vector_ns = cab_io_vector_period_get()) == 0) {
+        vector_ns = I2C_VECTOR_NS;
+    }
+
+    if ((err = cab_io_batch_begin()) == CAB_ERR_NONE) {
+        for (int i = 0; i < nsteps && err == CAB_ERR_NONE; i++) {
+            err = queue_step(&steps[i], &samples[i * I2C_STEP_SAMPLES]);
+        }
+
+        // Flush explicitly, even after an error, since the caller may have a
+        // batch open too, and the samples must be in before they're freed
+        end_err = cab_io_batch_flush();
+        if (err == CAB_ERR_NONE) {
+            err = end_err;
+        }
+
+        end_err = cab_io_batch_end();
+        if (err == CAB_ERR_NONE) {
+            err = end_err;
+        }
+    }
+
+    for (int i = 0; i < nsteps && err == CAB_ERR_NONE; i++) {
+        uint8_t *s = &samples[i * I2C_STEP_SAMPLES];
+
+        if (steps[i].op == CABBIC_I2C_WRITE) {
+            steps[i].ack = s[8] & 1;
+        } else if (steps[i].op == CABBIC_I2C_READ) {
+            steps[i].data = 0;
+            for (int b = 0; b < 8; b++) {
+                steps[i].data = steps[i].data << 1 | (s[b] & 1);
+            }
+        }
+    }
+
+    if (samples != stack_samples) {
+        free(samples);
+    }
+
+    cab_trace_end_arg(&span, "steps", nsteps);
+
+    return err;
 }
 
+// Run a transaction whose failure can't be reported to the caller
 static void
-set_sda_input()
+transfer(cabbic_i2c_step_t *steps, int nsteps, const char *caller)
 {
-    cab_io_pin_mode(I2C_PIN_SDA, CAB_PMODE_Z);
+    cab_err_e err;
+
+    if ((err = cabbic_i2c_transfer(steps, nsteps)) != CAB_ERR_NONE) {
+        fprintf(stderr, "%s(): %s\n", caller, cab_sterror(err));
+    }
 }
 
 void
 cabbic_i2c_start()
 {
-    set_i2c_pins(1, 1);
-    set_sda(0);
+    cabbic_i2c_step_t step = { CABBIC_I2C_START };
+
+    transfer(&step, 1, __func__);
 }
 
 void
 cabbic_i2c_stop()
 {
-    set_i2c_pins(1, 0);
-    set_sda(1);
+    cabbic_i2c_step_t step = { CABBIC_I2C_STOP };
+
+    transfer(&step, 1, __func__);
 }
 
 uint8_t
 cabbic_i2c_write_byte(uint8_t data)
 {
-    for (int i = 7; i >= 0; i--) {
-        set_scl(0);
-        set_sda((data >> i) & 1);
-        set_scl(1);
-    }
-
-    set_scl(0);
-    set_sda_input();
-    set_scl(1);
+    cabbic_i2c_step_t step = { CABBIC_I2C_WRITE, data, 1 };
 
-    // Read ACK
-    uint8_t input;
-    uint8_t data_pin = I2C_PIN_SDA;
-    cab_io_read(&data_pin, &input, 1);
+    transfer(&step, 1, __func__);
 
-    return input & 1;
+    return step.ack;
 }
 
 uint8_t
 cabbic_i2c_read_byte(uint8_t ack)
 {
-    set_sda_input();
+    cabbic_i2c_step_t step = { CABBIC_I2C_READ, 0xff, ack };
+
+    transfer(&step, 1, __func__);
+
+    return step.data;
+}
+
+// Check that every byte written was ACKed
+static cab_err_e
+check_acks(const cabbic_i2c_step_t *steps, int nsteps)
+{
+    for (int i = 0; i < nsteps; i++) {
+        if (steps[i].op == CABBIC_I2C_WRITE && steps[i].ack) {
+            return CAB_ERR_IO;
+        }
+    }
+
+    return CAB_ERR_NONE;
+}
+
+// Read 'n' bytes, after first writing the register number if 'reg' isn't
+// NULL, with a repeated start in between
+static cab_err_e
+read_transfer(uint8_t i2c_addr, const uint8_t *reg, uint8_t *buf, int n)
+{
+    cabbic_i2c_step_t *steps;
+    cab_err_e err;
+    int k = 0;
+
+    if (buf == NULL && n > 0) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if ((steps = calloc(n + 6, sizeof *steps)) == NULL) {
+        return CAB_ERR_NO_MEMORY;
+    }
+
+    if (reg) {
+        steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_START };
+        steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_WRITE, i2c_addr << 1 };
+        steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_WRITE, *reg };
+    }
+    steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_START };
+    steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_WRITE, i2c_addr << 1 | 1 };
+    for (int i = 0; i < n; i++) {
+        // The last byte is NACKed to end the read
+        steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_READ, 0xff, i == n - 1 };
+    }
+    steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_STOP };
+
+    if ((err = cabbic_i2c_transfer(steps, k)) == CAB_ERR_NONE) {
+        err = check_acks(steps, k);
+    }
+
+    for (int i = 0; i < n && err == CAB_ERR_NONE; i++) {
+        buf[i] = steps[k - 1 - n + i].data;
+    }
+
+    free(steps);
+
+    return err;
+}
+
+cab_err_e
+cabbic_i2c_read_bytes(uint8_t i2c_addr, uint8_t *buf, int n)
+{
+    TRACE_FUNCTION("i2c");
+
+    return read_transfer(i2c_addr, NULL, buf, n);
+}
+
+cab_err_e
+cabbic_i2c_read_registers(uint8_t i2c_addr, uint8_t reg, uint8_t *buf, int n)
+{
+    TRACE_FUNCTION("i2c");
+
+    return read_transfer(i2c_addr, &reg, buf, n);
+}
+
+cab_err_e
+cabbic_i2c_write_registers(uint8_t i2c_addr, uint8_t reg, const uint8_t *buf,
+  int n)
+{
+    TRACE_FUNCTION("i2c");
+    cabbic_i2c_step_t *steps;
+    cab_err_e err;
+    int k = 0;
 
-    uint8_t data_pin = I2C_PIN_SDA;
-    uint8_t data, input;
-    for (int i = 0; i < 8; i++) {
-        set_scl(0);
-        cab_io_read(&data_pin, &input, 1);
-        data = data << 1 | (input&1);
-        set_scl(1);
+    if (buf == NULL && n > 0) {
+        return CAB_ERR_BAD_POINTER;
     }
 
-    // Send ACK if not last byte, or NACK to complete the read sequence
-    set_sda(1);
-    set_scl(ack);
+    if ((steps = calloc(n + 4, sizeof *steps)) == NULL) {
+        return CAB_ERR_NO_MEMORY;
+    }
 
-    return data;
+    steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_START };
+    steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_WRITE, i2c_addr << 1 };
+    steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_WRITE, reg };
+    for (int i = 0; i < n; i++) {
+        steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_WRITE, buf[i] };
+    }
+    steps[k++] = (cabbic_i2c_step_t){ CABBIC_I2C_STOP };
+
+    if ((err = cabbic_i2c_transfer(steps, k)) == CAB_ERR_NONE) {
+        err = check_acks(steps, k);
+    }
+
+    free(steps);
+
+    return err;
 }
 
 void
 cabbic_i2c_write_register(uint8_t i2c_addr, uint8_t reg, uint8_t val)
 {
-    cabbic_i2c_start();
-    cabbic_i2c_write_byte(i2c_addr<<1);
-    cabbic_i2c_write_byte(reg);
-    cabbic_i2c_write_byte(val);
-    cabbic_i2c_stop();
+    cab_err_e err = cabbic_i2c_write_registers(i2c_addr, reg, &val, 1);
+
+    if (err != CAB_ERR_NONE && err != CAB_ERR_IO) {
+        fprintf(stderr, "%s(): %s\n", __func__, cab_sterror(err));
+    }
 }
 
 uint8_t
 cabbic_i2c_read_register(uint8_t i2c_addr, uint8_t reg)
 {
-    uint8_t val;
-
-    cabbic_i2c_start();
-    cabbic_i2c_write_byte(i2c_addr<<1);
-    cabbic_i2c_write_byte(reg);
-    cabbic_i2c_stop();
+    uint8_t val = 0xff;
+    cab_err_e err = cabbic_i2c_read_registers(i2c_addr, reg, &val, 1);
 
-    cabbic_i2c_start();
-    cabbic_i2c_write_byte(i2c_addr<<1 | 1);
-    val = cabbic_i2c_read_byte(1);
-    cabbic_i2c_stop();
+    if (err != CAB_ERR_NONE && err != CAB_ERR_IO) {
+        fprintf(stderr, "%s(): %s\n", __func__, cab_sterror(err));
+    }
 
     return val;
 }
@@ -0,0 +1,389 @@
+// Generic ROM reader.
+//
+// Reads are queued with cab_bus_read_async() inside one long batch, so the
+// vectors for consecutive locations are packed into full messages and
+// several messages are in flight at once.  The results are collected, and
+// the tickets released, every READER_CHUNK locations, which bounds the memory
+// used for tickets at the cost of letting the queue drain once per chunk.
+//
+// Chips which describe a stream state can instead be read with one vector
+// per location, in which the next address is driven while the data for the
+// previous one is sampled.  Whether a sample reflects the address driven in
+// the same vector or in the one before depends on how quickly the chip
+// responds, so that is worked out by comparing against ordinary reads before
+// starting, and the samples are realigned accordingly.  If neither alignment
+// matches, the ordinary cycle is used throughout.  A window of each chunk is
+// checked against ordinary reads too, since marginal timing may only show up
+// part way through, and if it doesn't match, that chunk and the rest are read
+// with the ordinary cycle.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <cabbic/api.h>
+#include <cabbic/bus.h>
+#include <cabbic/reader.h>
+
+#define READER_CHUNK        4096
+#define READER_QUEUE_DEPTH  8
+
+// Overlapped reads are checked against ordinary ones READER_CHECK locations at
+// a time, over at most the first READER_CHECK_MAX locations
+#define READER_CHECK        64
+#define READER_CHECK_MAX    4096
+
+typedef struct {
+    cab_ctx_t *ctx;
+    cab_bus_t *addr_bus;
+    cab_bus_t *data_bus;
+    bool pending;           // Pin steps have been made but not committed
+} reader_t;
+
+static int
+count_samples(const cab_rom_step_t *steps)
+{
+    int n = 0;
+
+    for (const cab_rom_step_t *s = steps; s && s->op != CAB_ROM_END; s++) {
+        n += s->op == CAB_ROM_SAMPLE;
+    }
+
+    return n;
+}
+
+static cab_err_e
+reader_commit(reader_t *r)
+{
+    if (!r->pending) {
+        return CAB_ERR_NONE;
+    }
+
+    r->pending = false;
+
+    return cab_ctx_io_hold_off(r->ctx);
+}
+
+// Run a list of steps for location 'addr'.  The ticket for the sample, if
+// there is one, is returned in 'ticket'.
+static cab_err_e
+reader_run(reader_t *r, const cab_rom_step_t *steps, uint32_t addr,
+  cab_ticket_t *ticket)
+{
+    cab_err_e err = CAB_ERR_NONE;
+
+    for (const cab_rom_step_t *s = steps;
+      s && s->op != CAB_ROM_END && err == CAB_ERR_NONE; s++) {
+        // Pin steps are held until something needs them applied
+        if (!r->pending && s->op >= CAB_ROM_ADDRESS &&
+          s->op <= CAB_ROM_PIN_1) {
+            if ((err = cab_ctx_io_hold_on(r->ctx)) != CAB_ERR_NONE) {
+                break;
+            }
+            r->pending = true;
+        }
+
+        switch (s->op) {
+            case CAB_ROM_ADDRESS:
+                err = cab_bus_write(r->addr_bus, addr);
+                break;
+            case CAB_ROM_RELEASE:
+                err = cab_bus_input(r->data_bus);
+                break;
+            case CAB_ROM_PIN_0:
+                err = cab_ctx_io_pin_mode(r->ctx, s->pin, CAB_PMODE_0);
+                break;
+            case CAB_ROM_PIN_1:
+                err = cab_ctx_io_pin_mode(r->ctx, s->pin, CAB_PMODE_1);
+                break;
+            case CAB_ROM_COMMIT:
+                err = reader_commit(r);
+                break;
+            case CAB_ROM_DELAY:
+                if ((err = reader_commit(r)) == CAB_ERR_NONE) {
+                    err = cab_ctx_delay_at_least(r->ctx, s->us);
+                }
+                break;
+            case CAB_ROM_SAMPLE:
+                // The read commits any held steps in the same vector
+                r->pending = false;
+                err = cab_bus_read_async(r->data_bus, ticket);
+                break;
+            default:
+                err = CAB_ERR_INVALID_PARAM;
+                break;
+        }
+    }
+
+    if (err == CAB_ERR_NONE) {
+        err = reader_commit(r);
+    }
+
+    return err;
+}
+
+// Collect the results of 'n' reads, and release their tickets
+static cab_err_e
+reader_collect(reader_t *r, cab_ticket_t *tickets, uint32_t n, uint8_t *data)
+{
+    uint64_t value;
+    cab_err_e err;
+
+    for (uint32_t i = 0; i < n; i++) {
+        err = cab_bus_collect(r->data_bus, tickets[i], &value);
+        if (err != CAB_ERR_NONE) {
+            return err;
+        }
+        data[i] = value;
+    }
+
+    return cab_ctx_io_tickets_release(r->ctx);
+}
+
+// Read 'n' locations from 'addr' by running the cycle steps for each
+static cab_err_e
+reader_cycles(reader_t *r, const cab_rom_t *rom, uint32_t addr, uint32_t n,
+  uint8_t *data)
+{
+    cab_ticket_t tickets[READER_CHUNK];
+    cab_err_e err;
+
+    for (uint32_t i = 0; i < n; i++) {
+        err = reader_run(r, rom->cycle, addr + i, &tickets[i]);
+        if (err != CAB_ERR_NONE) {
+            return err;
+        }
+    }
+
+    return reader_collect(r, tickets, n, data);
+}
+
+// Read 'n' locations from 'addr' with one vector per location, each driving
+// an address and sampling the data pins.  One more vector than there are
+// locations is sent, so that 'samples' receives n + 1 samples, and which of
+// them belongs to which location depends on the lag worked out by
+// reader_calibrate().
+static cab_err_e
+reader_stream(reader_t *r, uint32_t addr, uint32_t n, uint8_t *samples)
+{
+    cab_ticket_t tickets[READER_CHUNK + 1];
+    cab_err_e err;
+
+    for (uint32_t i = 0; i <= n; i++) {
+        if ((err = cab_ctx_io_hold_on(r->ctx)) != CAB_ERR_NONE ||
+          (err = cab_bus_write(r->addr_bus,
+          addr + (i < n ? i : n - 1))) != CAB_ERR_NONE ||
+          (err = cab_bus_read_async(r->data_bus,
+          &tickets[i])) != CAB_ERR_NONE) {
+            return err;
+        }
+    }
+
+    return reader_collect(r, tickets, n + 1, samples);
+}
+
+// Compare overlapped reads with ordinary ones, a window at a time, to find
+// whether each sample reflects the address driven in the same vector (a lag
+// of 0) or in the vector before (a lag of 1).  Windows where both would give
+// the same answer are skipped.  '*lag' is set to -1 if the overlapped reads
+// don't match, or to -2 if no window settles the question.
+static cab_err_e
+reader_calibrate(reader_t *r, const cab_rom_t *rom, int *lag)
+{
+    uint8_t expect[READER_CHECK], samples[READER_CHECK + 1];
+    cab_err_e err;
+
+    *lag = -2;
+
+    for (uint32_t base = 0; base < rom->size && base < READER_CHECK_MAX;
+      base += READER_CHECK) {
+        uint32_t n = rom->size - base;
+        if (n > READER_CHECK) {
+            n = READER_CHECK;
+        }
+
+        if ((err = reader_run(r, rom->init, 0, NULL)) != CAB_ERR_NONE ||
+          (err = reader_cycles(r, rom, base, n, expect)) != CAB_ERR_NONE ||
+          (err = reader_run(r, rom->stream, 0, NULL)) != CAB_ERR_NONE ||
+          (err = reader_stream(r, base, n, samples)) != CAB_ERR_NONE) {
+            return err;
+        }
+
+        bool same0 = memcmp(samples, expect, n) == 0;
+        bool same1 = memcmp(samples + 1, expect, n) == 0;
+
+        if (same0 != same1) {
+            *lag = same1;
+            break;
+        }
+        if (!same0) {
+            *lag = -1;
+            break;
+        }
+    }
+
+    return CAB_ERR_NONE;
+}
+
+// Check the end of a chunk which was read with overlapped reads against
+// ordinary reads, leaving the chip in its ordinary state.  '*ok' is set to
+// whether they match.  Timing which drifts part way through a chunk shows up
+// in its last locations, so they are the ones checked.
+static cab_err_e
+reader_verify(reader_t *r, const cab_rom_t *rom, uint32_t base, uint32_t n,
+  const uint8_t *data, bool *ok)
+{
+    uint32_t len = n < READER_CHECK ? n : READER_CHECK;
+    uint32_t off = n - len;
+    uint8_t expect[READER_CHECK];
+    cab_err_e err;
+
+    if ((err = reader_run(r, rom->init, 0, NULL)) != CAB_ERR_NONE ||
+      (err = reader_cycles(r, rom, base + off, len, expect)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    *ok = memcmp(data + off, expect, len) == 0;
+
+    return CAB_ERR_NONE;
+}
+
+static cab_err_e
+reader_read(reader_t *r, const cab_rom_t *rom, cab_rom_sink_fn sink,
+  void *arg)
+{
+    uint8_t data[READER_CHUNK + 1];
+    cab_err_e err;
+    int lag = -1;
+
+    if (rom->stream) {
+        if ((err = reader_calibrate(r, rom, &lag)) != CAB_ERR_NONE) {
+            return err;
+        }
+        if (lag == -1) {
+            fprintf(stderr, "Overlapped reads didn't match ordinary ones, "
+              "so they won't be used\n");
+        } else if (lag < 0) {
+            fprintf(stderr, "Couldn't calibrate the lag of overlapped reads "
+              "(the data may be blank), so they won't be used\n");
+        }
+    }
+
+    if ((err = reader_run(r, rom->init, 0, NULL)) != CAB_ERR_NONE) {
+        return err;
+    }
+    if (lag >= 0 &&
+      (err = reader_run(r, rom->stream, 0, NULL)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    for (uint32_t base = 0; base < rom->size; base += READER_CHUNK) {
+        uint32_t n = rom->size - base;
+        if (n > READER_CHUNK) {
+            n = READER_CHUNK;
+        }
+
+        if (lag >= 0) {
+            bool ok;
+
+            if ((err = reader_stream(r, base, n, data)) != CAB_ERR_NONE ||
+              (err = reader_verify(r, rom, base, n, data + lag,
+              &ok)) != CAB_ERR_NONE) {
+                return err;
+            }
+
+            if (ok) {
+                err = reader_run(r, rom->stream, 0, NULL);
+            } else {
+                fprintf(stderr, "Overlapped reads stopped matching ordinary "
+                  "ones at 0x%x, so they won't be used from there on\n",
+                  base);
+                lag = -1;
+                err = reader_cycles(r, rom, base, n, data);
+            }
+        } else {
+            err = reader_cycles(r, rom, base, n, data);
+        }
+        if (err != CAB_ERR_NONE) {
+            return err;
+        }
+
+        if ((err = sink(arg, base, data + (lag > 0), n)) != CAB_ERR_NONE) {
+            return err;
+        }
+    }
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_rom_read(cab_ctx_t *ctx, const cab_rom_t *rom, cab_rom_sink_fn sink,
+  void *arg)
+{
+    reader_t r = { ctx };
+    cab_err_e err, end_err;
+
+    if (ctx == NULL || rom == NULL || sink == NULL || rom->cycle == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if (rom->ndata < 1 || rom->ndata > 8 || rom->size == 0) {
+        return CAB_ERR_INVALID_PARAM;
+    }
+
+    // Each location is sampled exactly once
+    if (count_samples(rom->init) != 0 || count_samples(rom->stream) != 0 ||
+      count_samples(rom->cycle) != 1) {
+        return CAB_ERR_INVALID_PARAM;
+    }
+
+    if ((err = cab_ctx_reset(ctx, rom->gnd_pins, rom->ngnd, rom->vcc_pins,
+      rom->nvcc, rom->vpp_pins, rom->nvpp, rom->vcc_voltage,
+      rom->vpp_voltage)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    if ((err = cab_ctx_bus_create(ctx, rom->addr_pins, rom->naddr,
+      &r.addr_bus)) != CAB_ERR_NONE) {
+        return err;
+    }
+    if ((err = cab_ctx_bus_create(ctx, rom->data_pins, rom->ndata,
+      &r.data_bus)) != CAB_ERR_NONE) {
+        cab_bus_free(r.addr_bus);
+        return err;
+    }
+
+    if ((err = cab_ctx_set_queue_depth(ctx,
+      READER_QUEUE_DEPTH)) == CAB_ERR_NONE &&
+      (err = cab_ctx_io_batch_begin(ctx)) == CAB_ERR_NONE) {
+        err = reader_read(&r, rom, sink, arg);
+
+        end_err = cab_ctx_io_batch_end(ctx);
+        if (err == CAB_ERR_NONE) {
+            err = end_err;
+        }
+    }
+
+    cab_ctx_io_tickets_release(ctx);
+    cab_bus_free(r.addr_bus);
+    cab_bus_free(r.data_bus);
+
+    return err;
+}
+
+cab_err_e
+cab_rom_read(const cab_rom_t *rom, cab_rom_sink_fn sink, void *arg)
+{
+    return cab_ctx_rom_read(cab_ctx_default(), rom, sink, arg);
+}
+
+cab_err_e
+cab_rom_sink_file(void *arg, uint32_t addr, const uint8_t *data, size_t len)
+{
+    if (fwrite(data, 1, len, arg) != len) {
+        perror("cab_rom_sink_file()");
+        return CAB_ERR_FILE;
+    }
+
+    return CAB_ERR_NONE;
+}
@@ -0,0 +1,157 @@
+// Job runner, which spreads jobs across all the attached T48s.
+//
+// The job list is just a counter: each worker claims the next job number with
+// an atomic increment, so there is no locking between workers, and a slow or
+// failed programmer never holds up the others.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <cabbic/api.h>
+#include <cabbic/runner.h>
+#include "lib/trace.h"
+
+// Upper limit for the number of T48s used at once
+#define RUNNER_MAX_DEVICES  32
+
+typedef struct {
+    int njobs;
+    cab_setup_fn setup;
+    cab_job_fn job;
+    void *arg;
+    cab_err_e *results;
+    atomic_int next;
+} runner_t;
+
+typedef struct {
+    runner_t *runner;
+    cab_ctx_t *ctx;         // NULL until the worker has opened it
+    const char *serial;
+    pthread_t thread;
+    cab_err_e err;          // Why the worker couldn't run any jobs
+} worker_t;
+
+static void *
+worker_main(void *arg)
+{
+    worker_t *w = arg;
+    runner_t *r = w->runner;
+    int job;
+
+    trace_thread_name("runner");
+
+    if (w->ctx == NULL) {
+        w->err = cab_ctx_open_serial(NULL, w->serial, &w->ctx);
+        if (w->err != CAB_ERR_NONE) {
+            fprintf(stderr, "T48 %s: open failed: %s\n", w->serial,
+              cab_sterror(w->err));
+            return NULL;
+        }
+    }
+
+    if (r->setup && (w->err = r->setup(w->ctx, r->arg)) != CAB_ERR_NONE) {
+        fprintf(stderr, "T48 %s: setup failed: %s\n",
+          cab_ctx_serial(w->ctx), cab_sterror(w->err));
+    } else {
+        while ((job = atomic_fetch_add(&r->next, 1)) < r->njobs) {
+            r->results[job] = r->job(w->ctx, job, r->arg);
+        }
+    }
+
+    if (w->ctx != cab_ctx_default()) {
+        cab_ctx_close(w->ctx);
+    }
+
+    return NULL;
+}
+
+cab_err_e
+cab_run_jobs(int njobs, cab_setup_fn setup, cab_job_fn job, void *arg,
+  cab_err_e *results)
+{
+    cab_serial_t serials[RUNNER_MAX_DEVICES];
+    worker_t workers[RUNNER_MAX_DEVICES];
+    cab_ctx_t *ctx = cab_ctx_default();
+    cab_err_e err = CAB_ERR_NONE;
+    int count = 0, nworkers = 1;
+    cab_err_e *owned = NULL;
+    runner_t r;
+
+    if (job == NULL || ctx == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if (njobs < 0) {
+        return CAB_ERR_INVALID_PARAM;
+    }
+
+    if (results == NULL) {
+        if ((owned = malloc((njobs + 1) * sizeof *owned)) == NULL) {
+            return CAB_ERR_NO_MEMORY;
+        }
+        results = owned;
+    }
+
+    // Jobs which never get run are reported as such
+    for (int i = 0; i < njobs; i++) {
+        results[i] = CAB_ERR_STATE;
+    }
+
+    r.njobs = njobs;
+    r.setup = setup;
+    r.job = job;
+    r.arg = arg;
+    r.results = results;
+    atomic_init(&r.next, 0);
+
+    // The default context's T48 is always used.  If the transport can't list
+    // the others, it's the only one.
+    workers[0] = (worker_t){ &r, ctx, cab_ctx_serial(ctx) };
+
+    if (cab_enumerate(NULL, serials, RUNNER_MAX_DEVICES, &count) !=
+      CAB_ERR_NONE) {
+        count = 0;
+    }
+    if (count > RUNNER_MAX_DEVICES) {
+        fprintf(stderr, "Only using %d of %d T48s\n", RUNNER_MAX_DEVICES,
+          count);
+        count = RUNNER_MAX_DEVICES;
+    }
+
+    for (int i = 0; i < count && nworkers < RUNNER_MAX_DEVICES; i++) {
+        if (strcmp(serials[i], cab_ctx_serial(ctx)) != 0) {
+            workers[nworkers++] = (worker_t){ &r, NULL, serials[i] };
+        }
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main,
+          &workers[i]) != 0) {
+            fprintf(stderr, "cab_run_jobs(): Failed to create worker\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < njobs && err == CAB_ERR_NONE; i++) {
+        err = results[i];
+    }
+
+    // If no T48 could run the jobs, say why rather than just that they didn't
+    for (int i = 0; i < nworkers && atomic_load(&r.next) == 0; i++) {
+        if (workers[i].err != CAB_ERR_NONE) {
+            err = workers[i].err;
+            break;
+        }
+    }
+
+    free(owned);
+
+    return err;
+}
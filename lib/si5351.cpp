@@ -25,10 +25,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 //#include "Arduino.h"
 #include "Wire.h"
 #include "si5351.h"
+#include <cabbic/i2c.h>
 
 
 /********************/
@@ -44,6 +46,17 @@ Si5351::Si5351(uint8_t i2c_addr):
 	plla_ref_osc = SI5351_PLL_INPUT_XO;
 	pllb_ref_osc = SI5351_PLL_INPUT_XO;
 	clkin_div = SI5351_CLKIN_DIV_1;
+
+	// Nothing is known about the registers until they are read or written
+	for(int i = 0; i < SI5351_REGISTERS; i++)
+	{
+		reg_known[i] = false;
+		reg_dirty[i] = false;
+	}
+	stage_depth = 0;
+	record = NULL;
+	record_failed = false;
+	reg_touched = NULL;
 }
 
 /*
@@ -81,6 +94,14 @@ bool Si5351::init(uint8_t xtal_load_c, uint32_t xo_freq, int32_t corr)
 			status_reg = si5351_read(SI5351_DEVICE_STATUS);
 		} while (status_reg >> 7 == 1);
 
+		// Fill the register shadow, so that read-modify-write updates
+		// don't have to read from the device.  If this fails, registers
+		// are read as they're needed instead.
+		load_registers();
+
+		// The configuration below is sent in one commit
+		stage();
+
 		// Set crystal load capacitance
 		si5351_write(SI5351_CRYSTAL_LOAD, (xtal_load_c & SI5351_CRYSTAL_LOAD_MASK) | 0b00010010);
 
@@ -102,6 +123,8 @@ bool Si5351::init(uint8_t xtal_load_c, uint32_t xo_freq, int32_t corr)
 
 		reset();
 
+		commit();
+
 		return true;
 	}
 	else
@@ -118,6 +141,9 @@ bool Si5351::init(uint8_t xtal_load_c, uint32_t xo_freq, int32_t corr)
  */
 void Si5351::reset(void)
 {
+	// Everything below goes out in one commit, in datasheet order
+	stage();
+
 	// Initialize the CLK outputs according to flowchart in datasheet
 	// First, turn them off
 	si5351_write(16, 0x80);
@@ -179,6 +205,8 @@ void Si5351::reset(void)
 		output_enable((enum si5351_clock)i, 0);
 		clk_first_set[i] = false;
 	}
+
+	commit();
 }
 
 /*
@@ -192,6 +220,17 @@ void Si5351::reset(void)
  *   (use the si5351_clock enum)
  */
 uint8_t Si5351::set_freq(uint64_t freq, enum si5351_clock clk)
+{
+	uint8_t ret;
+
+	stage();
+	ret = set_freq_regs(freq, clk);
+	commit();
+
+	return ret;
+}
+
+uint8_t Si5351::set_freq_regs(uint64_t freq, enum si5351_clock clk)
 {
 	struct Si5351RegSet ms_reg;
 	uint64_t pll_freq;
@@ -1312,48 +1351,745 @@ void Si5351::set_ref_freq(uint32_t ref_freq, enum si5351_pll_input ref_osc)
 	//si5351_write(SI5351_PLL_INPUT_SOURCE, reg_val);
 }
 
+// Make room for another 'bytes' bytes of sweep data
+static bool sweep_reserve(struct Si5351Sweep *sweep, uint32_t bytes)
+{
+	uint32_t alloc = sweep->alloc ? sweep->alloc : 1024;
+	uint8_t *p;
+
+	while(sweep->size + bytes > alloc)
+	{
+		alloc *= 2;
+	}
+	if(alloc == sweep->alloc)
+	{
+		return true;
+	}
+
+	if((p = (uint8_t *)realloc(sweep->data, alloc)) == NULL)
+	{
+		return false;
+	}
+	sweep->data = p;
+	sweep->alloc = alloc;
+
+	return true;
+}
+
+// Add a run of register values to the step being built
+static bool sweep_append(struct Si5351Sweep *sweep, uint8_t addr, uint8_t bytes, const uint8_t *data)
+{
+	if(!sweep_reserve(sweep, 2 + bytes))
+	{
+		return false;
+	}
+
+	sweep->data[sweep->size++] = addr;
+	sweep->data[sweep->size++] = bytes;
+	memcpy(&sweep->data[sweep->size], data, bytes);
+	sweep->size += bytes;
+
+	return true;
+}
+
 uint8_t Si5351::si5351_write_bulk(uint8_t addr, uint8_t bytes, uint8_t *data)
 {
+	uint8_t ret;
+
+	// While staging, only the shadow is updated, and registers which
+	// already hold the value being written are left alone
+	if(stage_depth > 0 && addr + bytes <= SI5351_REGISTERS)
+	{
+		for(int i = 0; i < bytes; i++)
+		{
+			uint8_t reg = addr + i;
+
+			if(reg_touched != NULL)
+			{
+				reg_touched[reg] = true;
+			}
+			if(!reg_dirty[reg] && reg_known[reg] && reg_shadow[reg] == data[i])
+			{
+				continue;
+			}
+			if(!reg_dirty[reg])
+			{
+				reg_before[reg] = reg_known[reg] ? reg_shadow[reg] : 0;
+				reg_dirty[reg] = true;
+			}
+			else if(reg == SI5351_PLL_RESET)
+			{
+				// Resets of both PLLs may be staged
+				reg_shadow[reg] |= data[i];
+				continue;
+			}
+			reg_shadow[reg] = data[i];
+		}
+		return 0;
+	}
+
+	// Otherwise only the span between the first and last bytes which
+	// differ from the device's known contents is sent
+	while(bytes > 0 && addr < SI5351_REGISTERS && reg_known[addr] && reg_shadow[addr] == data[0])
+	{
+		addr++;
+		data++;
+		bytes--;
+	}
+	while(bytes > 0 && addr + bytes - 1 < SI5351_REGISTERS && reg_known[addr + bytes - 1] && reg_shadow[addr + bytes - 1] == data[bytes - 1])
+	{
+		bytes--;
+	}
+	if(bytes == 0)
+	{
+		return 0;
+	}
+
+	// While a sweep is being built, writes go into its table instead
+	if(record != NULL && addr + bytes <= SI5351_REGISTERS)
+	{
+		if(!sweep_append(record, addr, bytes, data))
+		{
+			record_failed = true;
+		}
+		for(int i = 0; i < bytes; i++)
+		{
+			reg_shadow[addr + i] = data[i];
+			reg_known[addr + i] = !reg_volatile(addr + i);
+		}
+		return 0;
+	}
+
 	Wire.beginTransmission(i2c_bus_addr);
 	Wire.write(addr);
 	for(int i = 0; i < bytes; i++)
 	{
 		Wire.write(data[i]);
 	}
-	return Wire.endTransmission();
+	ret = Wire.endTransmission();
+
+	// Keep the register shadow in step with what the device was sent
+	for(int i = 0; i < bytes && addr + i < SI5351_REGISTERS; i++)
+	{
+		reg_shadow[addr + i] = data[i];
+		reg_known[addr + i] = ret == 0 && !reg_volatile(addr + i);
+	}
 
+	return ret;
 }
 
 uint8_t Si5351::si5351_write(uint8_t addr, uint8_t data)
 {
-	Wire.beginTransmission(i2c_bus_addr);
-	Wire.write(addr);
-	Wire.write(data);
-	return Wire.endTransmission();
+	return si5351_write_bulk(addr, 1, &data);
 }
 
+/*
+ * si5351_read(uint8_t addr)
+ *
+ * Reads a register.  Status registers, and registers whose contents aren't
+ * known from load_registers() or an earlier write, are read from the device.
+ * Everything else, including staged changes, comes from the register shadow.
+ */
 uint8_t Si5351::si5351_read(uint8_t addr)
 {
 	uint8_t reg_val = 0;
 
-	Wire.beginTransmission(i2c_bus_addr);
-	Wire.write(addr);
-	Wire.endTransmission();
+	if(addr < SI5351_REGISTERS && (reg_known[addr] || reg_dirty[addr]))
+	{
+		return reg_shadow[addr];
+	}
 
-	Wire.requestFrom(i2c_bus_addr, (uint8_t)1);
+	// One transaction, with a repeated start before the read
+	if(cabbic_i2c_read_registers(i2c_bus_addr, addr, &reg_val, 1) != CAB_ERR_NONE)
+	{
+		return 0;
+	}
 
-	while(Wire.available())
+	if(addr < SI5351_REGISTERS && !reg_volatile(addr))
 	{
-		reg_val = Wire.read();
+		reg_shadow[addr] = reg_val;
+		reg_known[addr] = true;
 	}
 
 	return reg_val;
 }
 
+/*
+ * stage(void)
+ *
+ * Holds back register writes until the matching commit(), so that a series
+ * of changes can be sent together.  The register shadow is updated as usual,
+ * so reads see the staged values.  Calls may be nested, and only the
+ * outermost commit() writes to the device.
+ */
+void Si5351::stage(void)
+{
+	stage_depth++;
+}
+
+/*
+ * commit(void)
+ *
+ * Writes the registers changed since stage(), joining neighbouring registers
+ * into as few transfers as possible, in the order required by the datasheet:
+ * outputs being turned off, then the PLLs and their inputs, then the
+ * multisynths and output settings, then any PLL reset, and finally the
+ * outputs being turned on.
+ *
+ * Returns 0, or the Wire error code of the first write that failed.
+ */
+uint8_t Si5351::commit(void)
+{
+	uint8_t val[SI5351_REGISTERS];
+	bool dirty[SI5351_REGISTERS];
+	uint8_t ret = 0, err;
+
+	if(stage_depth == 0 || --stage_depth > 0)
+	{
+		return 0;
+	}
+
+	// The shadow goes back to the device's contents, and follows the writes
+	// below as they're made
+	for(int i = 0; i < SI5351_REGISTERS; i++)
+	{
+		val[i] = reg_shadow[i];
+		dirty[i] = reg_dirty[i];
+		if(dirty[i])
+		{
+			reg_shadow[i] = reg_before[i];
+		}
+		reg_dirty[i] = false;
+	}
+
+	// Outputs which end up disabled are disabled before anything else
+	// changes, and those which end up enabled only at the very end
+	if(dirty[SI5351_OUTPUT_ENABLE_CTRL])
+	{
+		uint8_t off = reg_before[SI5351_OUTPUT_ENABLE_CTRL] | val[SI5351_OUTPUT_ENABLE_CTRL];
+
+		if(off != reg_before[SI5351_OUTPUT_ENABLE_CTRL])
+		{
+			ret = si5351_write(SI5351_OUTPUT_ENABLE_CTRL, off);
+			if(off == val[SI5351_OUTPUT_ENABLE_CTRL])
+			{
+				dirty[SI5351_OUTPUT_ENABLE_CTRL] = false;
+			}
+		}
+	}
+
+	for(int phase = 0; phase < 5; phase++)
+	{
+		int reg = 0;
+
+		while(reg < SI5351_REGISTERS)
+		{
+			if(!dirty[reg] || commit_phase(reg, val[reg]) != phase)
+			{
+				reg++;
+				continue;
+			}
+
+			// Extend the run over further changes in the same phase, and
+			// across short gaps of registers known to be unchanged
+			int end = reg + 1;
+			for(int next = end; next < SI5351_REGISTERS && next <= end + SI5351_COMMIT_GAP; next++)
+			{
+				if(commit_phase(next, val[next]) != phase)
+				{
+					break;
+				}
+				if(dirty[next])
+				{
+					end = next + 1;
+				}
+				else if(!reg_known[next])
+				{
+					break;
+				}
+			}
+
+			err = si5351_write_bulk(reg, end - reg, &val[reg]);
+			if(ret == 0)
+			{
+				ret = err;
+			}
+
+			for(int i = reg; i < end; i++)
+			{
+				dirty[i] = false;
+			}
+			reg = end;
+		}
+	}
+
+	return ret;
+}
+
+// The commit() phase in which a register is written, given its new value
+int Si5351::commit_phase(uint8_t addr, uint8_t value)
+{
+	if(addr >= SI5351_CLK0_CTRL && addr <= SI5351_CLK7_CTRL)
+	{
+		// Output drivers being powered down go first
+		return (value & SI5351_CLK_POWERDOWN) ? 0 : 2;
+	}
+
+	switch(addr)
+	{
+		case SI5351_OUTPUT_ENABLE_CTRL:
+			return 4;
+		case SI5351_PLL_RESET:
+			return 3;
+		case SI5351_PLL_INPUT_SOURCE:
+		case SI5351_CRYSTAL_LOAD:
+		case SI5351_FANOUT_ENABLE:
+			return 1;
+	}
+
+	if((addr >= SI5351_PLLA_PARAMETERS && addr < SI5351_CLK0_PARAMETERS) ||
+		(addr >= SI5351_SSC_PARAM0 && addr <= SI5351_VXCO_PARAMETERS_HIGH))
+	{
+		return 1;
+	}
+
+	return 2;
+}
+
+/*
+ * load_registers(void)
+ *
+ * Fills the register shadow with a single burst read of the whole register
+ * map.  Returns false if the device didn't respond.
+ */
+bool Si5351::load_registers(void)
+{
+	if(cabbic_i2c_read_registers(i2c_bus_addr, 0, reg_shadow, SI5351_REGISTERS) != CAB_ERR_NONE)
+	{
+		return false;
+	}
+
+	for(int i = 0; i < SI5351_REGISTERS; i++)
+	{
+		reg_known[i] = !reg_volatile(i);
+	}
+
+	return true;
+}
+
+/*
+ * sweep_build(struct Si5351Sweep *sweep, const uint64_t *freqs,
+ *   uint32_t steps, enum si5351_clock clk)
+ *
+ * Works out the register writes that set_freq() would make to step clk
+ * through each of the frequencies in turn (in 0.01 Hz units), and stores them
+ * in sweep, without touching the device.  Step 0 writes every register which
+ * set_freq() writes during the sweep, whether or not the device already held
+ * the value, so playback doesn't depend on what the device was doing before.
+ * The sweep should be freed with si5351_sweep_free().
+ *
+ * Returns false if a frequency can't be set, or memory runs out.
+ */
+bool Si5351::sweep_build(struct Si5351Sweep *sweep, const uint64_t *freqs, uint32_t steps, enum si5351_clock clk)
+{
+	struct Si5351Sweep diffs = {};
+	uint8_t first_val[SI5351_REGISTERS];
+	bool first_touched[SI5351_REGISTERS], used[SI5351_REGISTERS] = {};
+	bool ok = steps > 0 && stage_depth == 0;
+
+	// Everything set_freq() changes is put back afterwards
+	Si5351 saved = *this;
+
+	memset(sweep, 0, sizeof *sweep);
+	sweep->clk = clk;
+	sweep->pll = pll_assignment[clk];
+	sweep->steps = steps;
+	sweep->freq = (uint64_t *)malloc(steps * sizeof *sweep->freq);
+	sweep->pll_freq = (uint64_t *)malloc(steps * sizeof *sweep->pll_freq);
+	sweep->start = (uint32_t *)malloc((steps + 1) * sizeof *sweep->start);
+	diffs.start = (uint32_t *)malloc((steps + 1) * sizeof *diffs.start);
+	ok = ok && sweep->freq && sweep->pll_freq && sweep->start && diffs.start;
+
+	// Record the changes made by each step, as commit() would write them,
+	// and every register written, even with the value it already held.  The
+	// first step is built as the clock's first set_freq(), so that it
+	// enables the output.
+	record_failed = false;
+	reg_touched = used;
+	clk_first_set[(uint8_t)clk] = false;
+	for(uint32_t i = 0; i < steps && ok; i++)
+	{
+		stage();
+		ok = set_freq_regs(freqs[i], clk) == 0;
+		if(i == 0)
+		{
+			memcpy(first_val, reg_shadow, sizeof first_val);
+			memcpy(first_touched, used, sizeof first_touched);
+		}
+
+		diffs.start[i] = diffs.size;
+		record = &diffs;
+		commit();
+		record = NULL;
+
+		sweep->freq[i] = freqs[i];
+		sweep->pll_freq[i] = sweep->pll == SI5351_PLLA ? plla_freq : pllb_freq;
+	}
+	if(ok)
+	{
+		diffs.start[steps] = diffs.size;
+		ok = !record_failed;
+	}
+
+	for(uint32_t p = 0; ok && p < diffs.size; p += 2 + diffs.data[p + 1])
+	{
+		for(int i = 0; i < diffs.data[p + 1]; i++)
+		{
+			used[diffs.data[p] + i] = true;
+		}
+	}
+
+	// Step 0 sets every register the sweep uses to its value after the first
+	// step, along with any PLL reset which that step makes.  A register which
+	// is first written by a later step is only included if its value was
+	// known, and otherwise left to that step.
+	*this = saved;
+	for(int i = 0; i < SI5351_REGISTERS && ok; i++)
+	{
+		if(reg_volatile(i) ? first_touched[i] : used[i] && (first_touched[i] || reg_known[i]))
+		{
+			reg_shadow[i] = first_val[i];
+			reg_before[i] = 0;
+			reg_dirty[i] = true;
+			reg_known[i] = false;
+		}
+	}
+
+	if(ok)
+	{
+		stage_depth = 1;
+		record = sweep;
+		commit();
+		ok = !record_failed;
+	}
+
+	// The later steps follow on unchanged
+	if(ok)
+	{
+		sweep->start[0] = 0;
+		sweep->start[1] = sweep->size;
+	}
+	for(uint32_t i = 1; i < steps && ok; i++)
+	{
+		uint32_t len = diffs.start[i + 1] - diffs.start[i];
+
+		if((ok = sweep_reserve(sweep, len)))
+		{
+			memcpy(&sweep->data[sweep->size], &diffs.data[diffs.start[i]], len);
+			sweep->size += len;
+			sweep->start[i + 1] = sweep->size;
+		}
+	}
+
+	*this = saved;
+	si5351_sweep_free(&diffs);
+	if(!ok)
+	{
+		si5351_sweep_free(sweep);
+	}
+
+	return ok;
+}
+
+/*
+ * sweep_build_range(struct Si5351Sweep *sweep, uint64_t start, uint64_t stop,
+ *   uint64_t step, enum si5351_clock clk)
+ *
+ * As sweep_build(), for the frequencies from start to stop (inclusive) in
+ * increments of step.
+ */
+bool Si5351::sweep_build_range(struct Si5351Sweep *sweep, uint64_t start, uint64_t stop, uint64_t step, enum si5351_clock clk)
+{
+	uint64_t *freqs;
+	uint64_t steps;
+	bool ok;
+
+	if(step == 0 || stop < start || (steps = (stop - start) / step + 1) > UINT32_MAX)
+	{
+		memset(sweep, 0, sizeof *sweep);
+		return false;
+	}
+
+	if((freqs = (uint64_t *)malloc(steps * sizeof *freqs)) == NULL)
+	{
+		memset(sweep, 0, sizeof *sweep);
+		return false;
+	}
+	for(uint64_t i = 0; i < steps; i++)
+	{
+		freqs[i] = start + i * step;
+	}
+
+	ok = sweep_build(sweep, freqs, steps, clk);
+	free(freqs);
+
+	return ok;
+}
+
+/*
+ * sweep_step(const struct Si5351Sweep *sweep, uint32_t step)
+ *
+ * Makes the writes for one step of a sweep.  Steps other than 0 assume that
+ * the step before was the last one made.  The clock's frequency and its
+ * PLL's frequency are updated as set_freq() would leave them.  A sweep built
+ * with the clock on a different PLL from the one it's on now is refused.
+ *
+ * Returns 0, or the Wire error code of the first write that failed.
+ */
+uint8_t Si5351::sweep_step(const struct Si5351Sweep *sweep, uint32_t step)
+{
+	uint8_t ret = 0, err;
+
+	if(step >= sweep->steps || pll_assignment[(uint8_t)sweep->clk] != sweep->pll)
+	{
+		return I2C_ERROR_OTHER;
+	}
+
+	for(uint32_t p = sweep->start[step]; p < sweep->start[step + 1]; p += 2 + sweep->data[p + 1])
+	{
+		err = si5351_write_bulk(sweep->data[p], sweep->data[p + 1], &sweep->data[p + 2]);
+		if(ret == 0)
+		{
+			ret = err;
+		}
+	}
+
+	clk_freq[(uint8_t)sweep->clk] = sweep->freq[step];
+	clk_first_set[(uint8_t)sweep->clk] = true;
+	if(sweep->pll == SI5351_PLLA)
+	{
+		plla_freq = sweep->pll_freq[step];
+	}
+	else
+	{
+		pllb_freq = sweep->pll_freq[step];
+	}
+
+	return ret;
+}
+
+/*
+ * sweep_play(const struct Si5351Sweep *sweep, unsigned long dwell_us)
+ *
+ * Runs through every step of a sweep, staying on each frequency for at least
+ * dwell_us microseconds.  The dwell is counted from when the last write of
+ * the step reached the T48, so USB latency counts towards it.
+ *
+ * Returns 0, or the Wire error code of the first write that failed.
+ */
+uint8_t Si5351::sweep_play(const struct Si5351Sweep *sweep, unsigned long dwell_us)
+{
+	uint8_t ret = 0, err;
+
+	for(uint32_t i = 0; i < sweep->steps; i++)
+	{
+		err = sweep_step(sweep, i);
+		if(ret == 0)
+		{
+			ret = err;
+		}
+
+		if(dwell_us > 0)
+		{
+			cab_delay_at_least(dwell_us);
+		}
+	}
+
+	return ret;
+}
+
+void si5351_sweep_free(struct Si5351Sweep *sweep)
+{
+	free(sweep->freq);
+	free(sweep->pll_freq);
+	free(sweep->start);
+	free(sweep->data);
+	memset(sweep, 0, sizeof *sweep);
+}
+
+// Sweep files hold a header of SWEEP_MAGIC, the format version, the clock,
+// its PLL, the number of steps and the size of the data, followed by the
+// frequencies, the PLL frequencies, the step offsets and the data, all
+// little-endian
+#define SWEEP_MAGIC		"SI5351SW"
+#define SWEEP_VERSION	2
+
+static bool sweep_put(FILE *f, uint64_t v, int bytes)
+{
+	for(int i = 0; i < bytes; i++)
+	{
+		if(fputc((v >> (8 * i)) & 0xff, f) == EOF)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool sweep_get(FILE *f, uint64_t *v, int bytes)
+{
+	*v = 0;
+	for(int i = 0; i < bytes; i++)
+	{
+		int c = fgetc(f);
+
+		if(c == EOF)
+		{
+			return false;
+		}
+		*v |= (uint64_t)c << (8 * i);
+	}
+
+	return true;
+}
+
+/*
+ * si5351_sweep_save(const struct Si5351Sweep *sweep, const char *path)
+ *
+ * Writes a sweep to a file, for later use with si5351_sweep_load().
+ */
+bool si5351_sweep_save(const struct Si5351Sweep *sweep, const char *path)
+{
+	FILE *f;
+	bool ok;
+
+	if((f = fopen(path, "wb")) == NULL)
+	{
+		perror(path);
+		return false;
+	}
+
+	ok = fwrite(SWEEP_MAGIC, 1, 8, f) == 8 &&
+		sweep_put(f, SWEEP_VERSION, 4) && sweep_put(f, sweep->clk, 4) &&
+		sweep_put(f, sweep->pll, 4) &&
+		sweep_put(f, sweep->steps, 4) && sweep_put(f, sweep->size, 4);
+	for(uint32_t i = 0; i < sweep->steps && ok; i++)
+	{
+		ok = sweep_put(f, sweep->freq[i], 8);
+	}
+	for(uint32_t i = 0; i < sweep->steps && ok; i++)
+	{
+		ok = sweep_put(f, sweep->pll_freq[i], 8);
+	}
+	for(uint32_t i = 0; i <= sweep->steps && ok; i++)
+	{
+		ok = sweep_put(f, sweep->start[i], 4);
+	}
+	ok = ok && fwrite(sweep->data, 1, sweep->size, f) == sweep->size;
+
+	if(fclose(f) != 0)
+	{
+		ok = false;
+	}
+	if(!ok)
+	{
+		fprintf(stderr, "%s: failed to write sweep\n", path);
+	}
+
+	return ok;
+}
+
+/*
+ * si5351_sweep_load(struct Si5351Sweep *sweep, const char *path)
+ *
+ * Reads a sweep written by si5351_sweep_save(), checking that it's well
+ * formed.  The sweep should be freed with si5351_sweep_free().
+ */
+bool si5351_sweep_load(struct Si5351Sweep *sweep, const char *path)
+{
+	char magic[8];
+	uint64_t version, clk, pll, steps, size, v;
+	FILE *f;
+	bool ok;
+
+	memset(sweep, 0, sizeof *sweep);
+
+	if((f = fopen(path, "rb")) == NULL)
+	{
+		perror(path);
+		return false;
+	}
+
+	ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, SWEEP_MAGIC, 8) == 0 &&
+		sweep_get(f, &version, 4) && version == SWEEP_VERSION &&
+		sweep_get(f, &clk, 4) && clk <= SI5351_CLK7 &&
+		sweep_get(f, &pll, 4) && pll <= SI5351_PLLB &&
+		sweep_get(f, &steps, 4) && steps > 0 && sweep_get(f, &size, 4);
+
+	if(ok)
+	{
+		sweep->clk = (enum si5351_clock)clk;
+		sweep->pll = (enum si5351_pll)pll;
+		sweep->steps = steps;
+		sweep->size = sweep->alloc = size;
+		sweep->freq = (uint64_t *)malloc(steps * sizeof *sweep->freq);
+		sweep->pll_freq = (uint64_t *)malloc(steps * sizeof *sweep->pll_freq);
+		sweep->start = (uint32_t *)malloc((steps + 1) * sizeof *sweep->start);
+		sweep->data = (uint8_t *)malloc(size ? size : 1);
+		ok = sweep->freq && sweep->pll_freq && sweep->start && sweep->data;
+	}
+	for(uint32_t i = 0; i < steps && ok; i++)
+	{
+		ok = sweep_get(f, &sweep->freq[i], 8);
+	}
+	for(uint32_t i = 0; i < steps && ok; i++)
+	{
+		ok = sweep_get(f, &sweep->pll_freq[i], 8);
+	}
+	for(uint32_t i = 0; i <= steps && ok; i++)
+	{
+		ok = sweep_get(f, &v, 4) && v <= size && (i == 0 ? v == 0 : v >= sweep->start[i - 1]);
+		sweep->start[i] = v;
+	}
+	ok = ok && sweep->start[steps] == size && fread(sweep->data, 1, size, f) == size;
+
+	// Every run must lie within its step and within the register map
+	for(uint32_t i = 0; i < steps && ok; i++)
+	{
+		uint32_t p = sweep->start[i];
+
+		while(ok && p < sweep->start[i + 1])
+		{
+			ok = p + 2 <= sweep->start[i + 1] && sweep->data[p + 1] > 0 &&
+				p + 2 + sweep->data[p + 1] <= sweep->start[i + 1] &&
+				sweep->data[p] + sweep->data[p + 1] <= SI5351_REGISTERS;
+			p += 2 + sweep->data[p + 1];
+		}
+	}
+
+	fclose(f);
+
+	if(!ok)
+	{
+		fprintf(stderr, "%s: not a valid sweep file\n", path);
+		si5351_sweep_free(sweep);
+	}
+
+	return ok;
+}
+
 /*********************/
 /* Private functions */
 /*********************/
 
+// Registers which the device changes by itself, and so can't be shadowed
+bool Si5351::reg_volatile(uint8_t addr)
+{
+	return addr == SI5351_DEVICE_STATUS || addr == SI5351_INTERRUPT_STATUS ||
+		addr == SI5351_PLL_RESET;
+}
+
 uint64_t Si5351::pll_calc(enum si5351_pll pll, uint64_t freq, struct Si5351RegSet *reg, int32_t correction, uint8_t vcxo)
 {
 	uint64_t ref_freq;
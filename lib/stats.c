@@ -0,0 +1,252 @@
+// Instrumentation for the core (see cabbic/stats.h).
+//
+// Each context keeps its own statistics, which are only touched by the thread
+// using that context: the I/O thread just moves messages, and their
+// submission and completion are both accounted for by the app thread.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <cabbic/api.h>
+#include <cabbic/t48.h>
+#include "stats.h"
+
+#define SUB_COUNT   (1 << CAB_STATS_SUB_BITS)
+
+
+static const char *cmd_names[CAB_STATS_NCMDS] = {
+    "QUERY",
+    "CONFIG_AND_READ",
+    "RESET_PINS",
+    "SET_VCC_PINS",
+    "SET_VPP_PINS",
+    "SET_GND_PINS",
+    "other",
+};
+
+static const char *api_names[CAB_STATS_NAPIS] = {
+    "(core)",
+    "cab_reset",
+    "cab_set_*_voltage",
+    "cab_io_pin_mode[s]",
+    "cab_io_hold_off",
+    "cab_io_read",
+    "cab_io_*read_async",
+    "cab_io_*collect",
+    "cab_io_port_mode",
+    "cab_io_port_write",
+    "cab_io_port_read",
+    "cab_io_batch_*",
+    "cab_delay_at_least",
+    "cab_io_set_and_read",
+};
+
+uint64_t
+stats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static cab_stats_cmd_e
+cmd_index(uint8_t cmd)
+{
+    switch (cmd) {
+        case T48_CMD_QUERY:
+            return CAB_STATS_CMD_QUERY;
+        case T48_CONFIG_AND_READ:
+            return CAB_STATS_CMD_CONFIG_AND_READ;
+        case T48_RESET_PINS:
+            return CAB_STATS_CMD_RESET_PINS;
+        case T48_SET_VCC_PINS:
+            return CAB_STATS_CMD_SET_VCC_PINS;
+        case T48_SET_VPP_PINS:
+            return CAB_STATS_CMD_SET_VPP_PINS;
+        case T48_SET_GND_PINS:
+            return CAB_STATS_CMD_SET_GND_PINS;
+        default:
+            return CAB_STATS_CMD_OTHER;
+    }
+}
+
+// Values below SUB_COUNT get a bucket each.  Above that, each power of two
+// is split into SUB_COUNT buckets using the bits below the leading one.
+static int
+bucket_of(uint64_t v)
+{
+    int msb, bucket;
+
+    if (v < SUB_COUNT) {
+        return v;
+    }
+
+    msb = 63 - __builtin_clzll(v);
+    bucket = ((msb - CAB_STATS_SUB_BITS + 1) << CAB_STATS_SUB_BITS) +
+      ((v >> (msb - CAB_STATS_SUB_BITS)) & (SUB_COUNT - 1));
+
+    return bucket < CAB_STATS_BUCKETS ? bucket : CAB_STATS_BUCKETS - 1;
+}
+
+// Highest value which falls into 'bucket'
+static uint64_t
+bucket_high(int bucket)
+{
+    int shift;
+
+    if (bucket < SUB_COUNT) {
+        return bucket;
+    }
+
+    shift = (bucket >> CAB_STATS_SUB_BITS) - 1;
+    return ((uint64_t)(SUB_COUNT + (bucket & (SUB_COUNT - 1)) + 1) << shift)
+      - 1;
+}
+
+const char *
+stats_cmd_name(uint8_t cmd)
+{
+    return cmd_names[cmd_index(cmd)];
+}
+
+void
+stats_api_enter(stats_t *s, cab_stats_api_e api)
+{
+    s->api = api;
+    s->stats.api[api].calls++;
+}
+
+void
+stats_message(stats_t *s, uint8_t cmd, int nvectors, int outl)
+{
+    cab_stats_cmd_e c = cmd_index(cmd);
+
+    s->stats.cmd[c].messages++;
+    s->stats.cmd[c].vectors += nvectors;
+    s->stats.cmd[c].bytes_out += outl;
+    s->stats.api[s->api].messages++;
+}
+
+void
+stats_exchange(stats_t *s, uint8_t cmd, int inl, uint64_t submitted,
+  uint64_t wait_start, uint64_t wait_end)
+{
+    uint64_t latency = wait_end - submitted;
+
+    s->stats.cmd[cmd_index(cmd)].bytes_in += inl;
+    s->stats.usb_wait += wait_end - wait_start;
+
+    if (s->stats.latency_count == 0 || latency < s->stats.latency_min) {
+        s->stats.latency_min = latency;
+    }
+    if (latency > s->stats.latency_max) {
+        s->stats.latency_max = latency;
+    }
+    s->stats.latency_count++;
+    s->stats.latency_total += latency;
+    s->stats.latency[bucket_of(latency)]++;
+}
+
+void
+stats_sleep(stats_t *s, uint64_t ns)
+{
+    s->stats.sleep += ns;
+}
+
+void
+stats_reset(stats_t *s)
+{
+    memset(s, 0, sizeof *s);
+    s->start = stats_now();
+}
+
+void
+stats_get(stats_t *s, cab_stats_t *out)
+{
+    *out = s->stats;
+
+    out->wall = stats_now() - s->start;
+    out->compute = out->wall - out->usb_wait - out->sleep;
+    if (out->usb_wait + out->sleep > out->wall) {
+        out->compute = 0;
+    }
+}
+
+uint64_t
+cab_stats_percentile(const cab_stats_t *s, double percentile)
+{
+    uint64_t target = s->latency_count * percentile / 100, seen = 0;
+
+    if (s->latency_count == 0) {
+        return 0;
+    }
+
+    for (int b = 0; b < CAB_STATS_BUCKETS; b++) {
+        seen += s->latency[b];
+        if (seen > target || seen == s->latency_count) {
+            uint64_t high = bucket_high(b);
+            return high < s->latency_max ? high : s->latency_max;
+        }
+    }
+
+    return s->latency_max;
+}
+
+static double
+percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0;
+}
+
+void
+cab_stats_print(const cab_stats_t *s, FILE *f)
+{
+    fprintf(f, "Time: %.3fs total, %.3fs USB wait (%.1f%%), "
+      "%.3fs sleep (%.1f%%), %.3fs compute (%.1f%%)\n",
+      s->wall / 1e9,
+      s->usb_wait / 1e9, percent(s->usb_wait, s->wall),
+      s->sleep / 1e9, percent(s->sleep, s->wall),
+      s->compute / 1e9, percent(s->compute, s->wall));
+
+    fprintf(f, "%-20s %10s %10s %12s %12s\n",
+      "Command", "Messages", "Vectors", "Bytes out", "Bytes in");
+    for (int c = 0; c < CAB_STATS_NCMDS; c++) {
+        if (s->cmd[c].messages == 0) {
+            continue;
+        }
+        fprintf(f, "%-20s %10llu %10llu %12llu %12llu\n", cmd_names[c],
+          (unsigned long long)s->cmd[c].messages,
+          (unsigned long long)s->cmd[c].vectors,
+          (unsigned long long)s->cmd[c].bytes_out,
+          (unsigned long long)s->cmd[c].bytes_in);
+    }
+
+    fprintf(f, "%-20s %10s %10s %12s\n",
+      "API", "Calls", "Messages", "Msgs/call");
+    for (int a = 0; a < CAB_STATS_NAPIS; a++) {
+        if (s->api[a].calls == 0 && s->api[a].messages == 0) {
+            continue;
+        }
+        fprintf(f, "%-20s %10llu %10llu %12.3f\n", api_names[a],
+          (unsigned long long)s->api[a].calls,
+          (unsigned long long)s->api[a].messages,
+          s->api[a].calls ? (double)s->api[a].messages / s->api[a].calls : 0);
+    }
+
+    if (s->latency_count == 0) {
+        return;
+    }
+
+    fprintf(f, "Latency (us): n=%llu min=%.1f mean=%.1f p50=%.1f p90=%.1f "
+      "p99=%.1f p99.9=%.1f max=%.1f\n",
+      (unsigned long long)s->latency_count,
+      s->latency_min / 1e3,
+      (double)s->latency_total / s->latency_count / 1e3,
+      cab_stats_percentile(s, 50) / 1e3,
+      cab_stats_percentile(s, 90) / 1e3,
+      cab_stats_percentile(s, 99) / 1e3,
+      cab_stats_percentile(s, 99.9) / 1e3,
+      s->latency_max / 1e3);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cabbic/stats.h>
+
+// Hooks through which the core feeds the statistics in cabbic/stats.h.
+// Each context has its own stats_t, which must only be used by the thread
+// driving that context.
+
+typedef struct {
+    cab_stats_t stats;
+    uint64_t start;
+    cab_stats_api_e api;    // Call which subsequent messages are charged to
+} stats_t;
+
+uint64_t stats_now();
+
+void stats_reset(stats_t *s);
+void stats_get(stats_t *s, cab_stats_t *out);
+
+// Name of a T48 command, for reports
+const char *stats_cmd_name(uint8_t cmd);
+
+// Charge subsequent messages to 'api', and count a call to it
+void stats_api_enter(stats_t *s, cab_stats_api_e api);
+
+void stats_message(stats_t *s, uint8_t cmd, int nvectors, int outl);
+void stats_exchange(stats_t *s, uint8_t cmd, int inl, uint64_t submitted,
+  uint64_t wait_start, uint64_t wait_end);
+void stats_sleep(stats_t *s, uint64_t ns);
@@ -0,0 +1,129 @@
+// Transport which talks to a T48 owned by cabbicd, via a Unix socket.
+//
+// The daemon keeps the device open, answers the startup query from a cache,
+// and skips power configuration which is already in effect, so short runs
+// don't pay for device discovery and power-up each time.  The socket path is
+// taken from CABBIC_SOCKET, if set.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <cabbic/cabbicd.h>
+#include <cabbic/transport.h>
+
+typedef struct {
+    cab_transport_t tp;
+    int fd;
+} daemon_transport_t;
+
+static void
+io_all(int fd, void *buf, size_t len, bool out)
+{
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = out ? write(fd, p, len) : read(fd, p, len);
+        if (n <= 0) {
+            fprintf(stderr, "cabbicd connection %s\n",
+              n == 0 ? "closed" : "failed");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+// The daemon owns a single T48, so there is no choice to be made here.  The
+// core checks that its serial number matches the one asked for.
+static cab_transport_t *
+daemon_open(const char *serial)
+{
+    const char *path = getenv("CABBIC_SOCKET");
+    struct sockaddr_un addr;
+    daemon_transport_t *d;
+
+    if (path == NULL) {
+        path = CABBICD_SOCKET;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((d = calloc(1, sizeof *d)) == NULL) {
+        fprintf(stderr, "daemon_open(): Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    d->tp.ops = &cab_t48_daemon_transport;
+
+    if ((d->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      connect(d->fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        perror(path);
+        if (d->fd >= 0) {
+            close(d->fd);
+        }
+        free(d);
+        return NULL;
+    }
+
+    return &d->tp;
+}
+
+static void
+daemon_close(cab_transport_t *tp)
+{
+    daemon_transport_t *d = (daemon_transport_t *)tp;
+
+    close(d->fd);
+    free(d);
+}
+
+static void
+daemon_submit(cab_transport_t *tp, cab_xfer_t *xfer)
+{
+    daemon_transport_t *d = (daemon_transport_t *)tp;
+    cabbicd_request_t req = { xfer->outl, xfer->inl };
+
+    xfer->done = 0;
+    xfer->actual_inl = 0;
+
+    io_all(d->fd, &req, sizeof req, true);
+    io_all(d->fd, xfer->out, xfer->outl, true);
+}
+
+static void
+daemon_wait(cab_transport_t *tp, cab_xfer_t *xfer)
+{
+    daemon_transport_t *d = (daemon_transport_t *)tp;
+    cabbicd_reply_t reply;
+
+    io_all(d->fd, &reply, sizeof reply, false);
+
+    if (reply.status != 0 || reply.inl > xfer->inl) {
+        fprintf(stderr, "cabbicd rejected a request\n");
+        exit(EXIT_FAILURE);
+    }
+
+    io_all(d->fd, xfer->in, reply.inl, false);
+
+    xfer->actual_inl = reply.inl;
+    xfer->done = 1;
+}
+
+const cab_transport_ops_t cab_t48_daemon_transport = {
+    "daemon",
+    daemon_open,
+    daemon_close,
+    daemon_submit,
+    daemon_wait,
+    NULL,
+    NULL,
+};
@@ -0,0 +1,303 @@
+// Software T48, for running and profiling apps without a programmer.
+//
+// Messages are interpreted as soon as they are submitted, but each exchange
+// only completes once the simulated round trip latency (CABBIC_SIM_LATENCY_US,
+// 250us by default) has passed since its submission, and never before the
+// exchange submitted ahead of it.  This models a pipelined link, so queueing
+// and batching have the same kind of effect as on real hardware.
+//
+// CABBIC_SIM_VECTOR_NS adds a time for the T48 to apply each vector (none by
+// default).
+//
+// CABBIC_SIM_DEVICES programmers are available, with serial numbers
+// SIM0000000000000, SIM0000000000001 and so on.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <cabbic/api.h>
+#include <cabbic/sim.h>
+#include <cabbic/t48.h>
+#include <cabbic/transport.h>
+
+#define SIM_LATENCY_US      250
+
+// Must be at least as large as the core's queue of in-flight messages
+#define SIM_QUEUE_MAX       64
+
+#define SIM_MAX_DEVICES     64
+
+typedef struct {
+    cab_transport_t tp;
+    int index;
+    uint64_t latency_ns;
+    uint64_t vector_ns;
+    uint64_t deadlines[SIM_QUEUE_MAX];
+    unsigned first, count;
+    uint8_t io[T48_VECTOR_BYTES];
+} sim_transport_t;
+
+static cab_sim_device_fn sim_device;
+static void *sim_device_arg;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool sim_in_use[SIM_MAX_DEVICES];
+
+void
+cab_sim_attach(cab_sim_device_fn device, void *arg)
+{
+    sim_device = device;
+    sim_device_arg = arg;
+}
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+sim_ndevices()
+{
+    const char *devices = getenv("CABBIC_SIM_DEVICES");
+    int n = devices ? atoi(devices) : 1;
+
+    if (n < 1 || n > SIM_MAX_DEVICES) {
+        fprintf(stderr, "CABBIC_SIM_DEVICES must be from 1 to %d\n",
+          SIM_MAX_DEVICES);
+        exit(EXIT_FAILURE);
+    }
+
+    return n;
+}
+
+static void
+sim_serial(int index, cab_serial_t serial)
+{
+    snprintf(serial, CAB_SERIAL_MAX, "SIM%013d", index);
+}
+
+static cab_transport_t *
+sim_open(const char *serial)
+{
+    sim_transport_t *sim;
+    const char *latency = getenv("CABBIC_SIM_LATENCY_US");
+    const char *vector = getenv("CABBIC_SIM_VECTOR_NS");
+    int index, n = sim_ndevices();
+    cab_serial_t s;
+
+    pthread_mutex_lock(&sim_lock);
+    for (index = 0; index < n; index++) {
+        sim_serial(index, s);
+        if (!sim_in_use[index] &&
+          (serial == NULL || strcmp(serial, s) == 0)) {
+            break;
+        }
+    }
+    if (index == n) {
+        pthread_mutex_unlock(&sim_lock);
+        if (serial) {
+            fprintf(stderr, "No T48 with serial number %s detected\n",
+              serial);
+        } else {
+            fprintf(stderr, "No T48 detected\n");
+        }
+        return NULL;
+    }
+    sim_in_use[index] = true;
+    pthread_mutex_unlock(&sim_lock);
+
+    if ((sim = calloc(1, sizeof *sim)) == NULL) {
+        fprintf(stderr, "sim_open(): Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    sim->tp.ops = &cab_t48_sim_transport;
+    sim->index = index;
+    sim->latency_ns = (latency ? atol(latency) : SIM_LATENCY_US) * 1000ULL;
+    sim->vector_ns = vector ? atol(vector) : 0;
+    memset(sim->io, CAB_PMODE_Z << 4 | CAB_PMODE_Z, sizeof sim->io);
+
+    return &sim->tp;
+}
+
+static void
+sim_close(cab_transport_t *tp)
+{
+    sim_transport_t *sim = (sim_transport_t *)tp;
+
+    pthread_mutex_lock(&sim_lock);
+    sim_in_use[sim->index] = false;
+    pthread_mutex_unlock(&sim_lock);
+
+    free(sim);
+}
+
+static int
+sim_enumerate(cab_serial_t *serials, int max)
+{
+    int n = sim_ndevices();
+
+    for (int i = 0; i < n && i < max; i++) {
+        sim_serial(i, serials[i]);
+    }
+
+    return n;
+}
+
+static int
+sim_query(sim_transport_t *sim, uint8_t *reply)
+{
+    cab_serial_t serial;
+
+    memset(reply, 0, T48_QUERY_REPLY);
+    sim_serial(sim->index, serial);
+
+    reply[4] = 0;               // Firmware version 1.00
+    reply[5] = 1;
+    reply[6] = T48_DEVTYPE;
+    memcpy(&reply[8], "2024-01-01", 10);
+    memcpy(&reply[24], "SIMT48", 6);
+    memcpy(&reply[T48_SERIAL_OFFSET], serial, strlen(serial));
+    reply[56] = 1522 & 0xff;    // About 5V from the USB supply
+    reply[57] = 1522 >> 8;
+    reply[60] = 1;              // 480Mbps
+
+    return T48_QUERY_REPLY;
+}
+
+// Apply each vector in turn, and replace it with the levels read back
+static int
+sim_config_and_read(sim_transport_t *sim, uint8_t *msg, int len, uint8_t *reply)
+{
+    int nvectors = msg[4];
+    bool pullup = msg[1] & 0x80;
+
+    if (len < 8 + nvectors * T48_VECTOR_BYTES) {
+        fprintf(stderr, "sim: short CONFIG_AND_READ message\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(reply, msg, len);
+    reply[1] = 0;               // No overcurrent
+
+    for (int v = 0; v < nvectors; v++) {
+        uint8_t *vector = &reply[8 + v * T48_VECTOR_BYTES];
+        uint64_t driven = 0, levels = 0, inputs;
+
+        memcpy(sim->io, vector, T48_VECTOR_BYTES);
+
+        for (int pin = 0; pin < T48_VECTOR_PINS; pin++) {
+            uint8_t mode = (vector[pin>>1] >> ((pin&1) ? 4 : 0)) & 0xf;
+
+            if (mode == CAB_PMODE_0 || mode == CAB_PMODE_G) {
+                driven |= 1ULL << pin;
+            } else if (mode == CAB_PMODE_1 || mode == CAB_PMODE_V) {
+                driven |= 1ULL << pin;
+                levels |= 1ULL << pin;
+            }
+        }
+
+        if (sim_device) {
+            inputs = sim_device(sim_device_arg, driven, levels);
+        } else {
+            inputs = pullup ? ~0ULL : 0;
+        }
+        levels |= inputs & ~driven;
+
+        memset(vector, 0, T48_VECTOR_BYTES);
+        for (int pin = 0; pin < T48_VECTOR_PINS; pin++) {
+            vector[pin>>1] |= ((levels >> pin) & 1) << ((pin&1) ? 4 : 0);
+        }
+    }
+
+    return len;
+}
+
+static void
+sim_submit(cab_transport_t *tp, cab_xfer_t *xfer)
+{
+    sim_transport_t *sim = (sim_transport_t *)tp;
+    uint8_t reply[T48_VECTOR_MSG_MAX];
+    uint64_t deadline = now_ns() + sim->latency_ns;
+    int replyl = 0, nvectors = 0;
+
+    if (sim->count == SIM_QUEUE_MAX) {
+        fprintf(stderr, "sim: too many exchanges in flight\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (xfer->outl > 0) {
+        switch (xfer->out[0]) {
+            case T48_CMD_QUERY:
+                replyl = sim_query(sim, reply);
+                break;
+            case T48_CONFIG_AND_READ:
+                replyl = sim_config_and_read(sim, xfer->out, xfer->outl,
+                  reply);
+                nvectors = xfer->out[4];
+                break;
+            case T48_RESET_PINS:
+                memset(sim->io, CAB_PMODE_Z << 4 | CAB_PMODE_Z,
+                  sizeof sim->io);
+                break;
+            case T48_SET_VCC_PINS:
+            case T48_SET_VPP_PINS:
+            case T48_SET_GND_PINS:
+                break;
+            default:
+                fprintf(stderr, "sim: unknown command 0x%02x\n",
+                  xfer->out[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    xfer->actual_inl = replyl < xfer->inl ? replyl : xfer->inl;
+    if (xfer->actual_inl > 0) {
+        memcpy(xfer->in, reply, xfer->actual_inl);
+    }
+    xfer->done = 0;
+
+    if (sim->count > 0) {
+        uint64_t prev = sim->deadlines[(sim->first + sim->count - 1) %
+          SIM_QUEUE_MAX];
+        if (deadline < prev) {
+            deadline = prev;
+        }
+    }
+    deadline += nvectors * sim->vector_ns;
+    sim->deadlines[(sim->first + sim->count++) % SIM_QUEUE_MAX] = deadline;
+}
+
+static void
+sim_wait(cab_transport_t *tp, cab_xfer_t *xfer)
+{
+    sim_transport_t *sim = (sim_transport_t *)tp;
+    uint64_t deadline = sim->deadlines[sim->first];
+    struct timespec ts = {
+        deadline / 1000000000, deadline % 1000000000
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    }
+
+    sim->first = (sim->first + 1) % SIM_QUEUE_MAX;
+    sim->count--;
+    xfer->done = 1;
+}
+
+const cab_transport_ops_t cab_t48_sim_transport = {
+    "sim",
+    sim_open,
+    sim_close,
+    sim_submit,
+    sim_wait,
+    sim_enumerate,
+    NULL,
+};
@@ -0,0 +1,371 @@
+// Transport which talks to a real T48 via libusb.
+//
+// Exchanges are submitted using the libusb asynchronous API, so several can
+// be in flight at once.  The libusb transfers are allocated the first time a
+// cab_xfer_t is used, and then reused, so the core's preallocated message
+// slots don't cause any allocation in the steady state.
+//
+// Several T48s may be open at once, each from its own thread.  Programmers
+// are told apart by the serial number in their reply to T48_CMD_QUERY, and
+// the ones this process has open are remembered, so that they aren't opened
+// twice or sent queries while they're busy.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include <cabbic/t48.h>
+#include <cabbic/transport.h>
+
+#define USB_TIMEOUT 5000
+
+// Upper limit for the number of T48s open at once
+#define USB_MAX_OPEN        32
+
+typedef struct {
+    cab_transport_t tp;
+    libusb_device_handle *handle;
+} usb_transport_t;
+
+typedef struct {
+    libusb_device *dev;
+    cab_serial_t serial;
+} usb_open_t;
+
+static pthread_mutex_t usb_lock = PTHREAD_MUTEX_INITIALIZER;
+static usb_open_t usb_opened[USB_MAX_OPEN];
+
+static void
+usb_errchk(const char *what, int err)
+{
+    if (err < 0) {
+        fprintf(stderr, "%s: %s\n", what, libusb_error_name(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static usb_open_t *
+usb_find_opened(libusb_device *dev)
+{
+    for (int i = 0; i < USB_MAX_OPEN; i++) {
+        if (usb_opened[i].dev == dev) {
+            return &usb_opened[i];
+        }
+    }
+
+    return NULL;
+}
+
+static bool
+usb_is_t48(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    int rc;
+
+    rc = libusb_get_device_descriptor(dev, &desc);
+    usb_errchk("libusb_get_device_descriptor()", rc);
+
+    return desc.idVendor == T48_USB_VID && desc.idProduct == T48_USB_PID;
+}
+
+// Ask an idle T48 for its serial number
+static int
+usb_query_serial(libusb_device_handle *handle, cab_serial_t serial)
+{
+    uint8_t msg[T48_QUERY_REPLY];
+    int rc, len;
+
+    memset(msg, 0, sizeof msg);
+    msg[0] = T48_CMD_QUERY;
+
+    rc = libusb_bulk_transfer(handle, LIBUSB_ENDPOINT_OUT|1, msg, 5, &len,
+      USB_TIMEOUT);
+    if (rc == 0) {
+        rc = libusb_bulk_transfer(handle, LIBUSB_ENDPOINT_IN|1, msg,
+          sizeof msg, &len, USB_TIMEOUT);
+    }
+    if (rc < 0) {
+        return rc;
+    }
+
+    memset(serial, 0, CAB_SERIAL_MAX);
+    if (len >= T48_SERIAL_OFFSET + T48_SERIAL_LEN) {
+        memcpy(serial, &msg[T48_SERIAL_OFFSET], T48_SERIAL_LEN);
+    }
+
+    return 0;
+}
+
+static cab_transport_t *
+usb_open(const char *serial)
+{
+    libusb_device **list, *dev, *found = NULL;
+    libusb_device_handle *handle = NULL;
+    usb_transport_t *usb;
+    usb_open_t *slot;
+    cab_serial_t s;
+    ssize_t ndevices;
+    int rc;
+
+    rc = libusb_init(NULL);
+    usb_errchk("libusb_init()", rc);
+
+    pthread_mutex_lock(&usb_lock);
+
+    if ((slot = usb_find_opened(NULL)) == NULL) {
+        pthread_mutex_unlock(&usb_lock);
+        fprintf(stderr, "Too many T48s open\n");
+        libusb_exit(NULL);
+        return NULL;
+    }
+
+    ndevices = libusb_get_device_list(NULL, &list);
+    usb_errchk("libusb_get_device_list()", ndevices);
+
+    for (int i = 0; i < ndevices; i++) {
+        dev = list[i];
+        if (dev == NULL) {
+            break;
+        }
+
+        if (!usb_is_t48(dev) || usb_find_opened(dev) != NULL) {
+            continue;
+        }
+
+        rc = libusb_open(dev, &handle);
+        if (rc < 0) {
+            fprintf(stderr, "libusb_open(): %s\n", libusb_error_name(rc));
+            continue;
+        }
+
+        rc = usb_query_serial(handle, s);
+        if (rc < 0) {
+            fprintf(stderr, "usb_open(): query failed: %s\n",
+              libusb_error_name(rc));
+        } else if (serial == NULL || strcmp(serial, s) == 0) {
+            found = dev;
+            break;
+        }
+
+        libusb_close(handle);
+    }
+
+    if (found == NULL) {
+        pthread_mutex_unlock(&usb_lock);
+        if (serial) {
+            fprintf(stderr, "No T48 with serial number %s detected\n",
+              serial);
+        } else {
+            fprintf(stderr, "No T48 detected\n");
+        }
+        libusb_free_device_list(list, 1);
+        libusb_exit(NULL);
+        return NULL;
+    }
+
+    slot->dev = libusb_ref_device(found);
+    memcpy(slot->serial, s, sizeof s);
+
+    pthread_mutex_unlock(&usb_lock);
+
+    libusb_free_device_list(list, 1);
+
+    if ((usb = calloc(1, sizeof *usb)) == NULL) {
+        fprintf(stderr, "usb_open(): Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    usb->tp.ops = &cab_t48_usb_transport;
+    usb->handle = handle;
+
+    return &usb->tp;
+}
+
+static int
+usb_enumerate(cab_serial_t *serials, int max)
+{
+    libusb_device **list, *dev;
+    libusb_device_handle *handle;
+    usb_open_t *opened;
+    cab_serial_t s;
+    ssize_t ndevices;
+    int rc, count = 0;
+
+    rc = libusb_init(NULL);
+    usb_errchk("libusb_init()", rc);
+
+    pthread_mutex_lock(&usb_lock);
+
+    ndevices = libusb_get_device_list(NULL, &list);
+    usb_errchk("libusb_get_device_list()", ndevices);
+
+    for (int i = 0; i < ndevices; i++) {
+        dev = list[i];
+        if (dev == NULL) {
+            break;
+        }
+
+        if (!usb_is_t48(dev)) {
+            continue;
+        }
+
+        // Don't disturb T48s which are in use
+        if ((opened = usb_find_opened(dev)) != NULL) {
+            memcpy(s, opened->serial, sizeof s);
+        } else {
+            rc = libusb_open(dev, &handle);
+            if (rc < 0) {
+                fprintf(stderr, "libusb_open(): %s\n", libusb_error_name(rc));
+                continue;
+            }
+            rc = usb_query_serial(handle, s);
+            libusb_close(handle);
+            if (rc < 0) {
+                fprintf(stderr, "usb_enumerate(): query failed: %s\n",
+                  libusb_error_name(rc));
+                continue;
+            }
+        }
+
+        if (count < max) {
+            memcpy(serials[count], s, sizeof s);
+        }
+        count++;
+    }
+
+    pthread_mutex_unlock(&usb_lock);
+
+    libusb_free_device_list(list, 1);
+    libusb_exit(NULL);
+
+    return count;
+}
+
+static void
+usb_close(cab_transport_t *tp)
+{
+    usb_transport_t *usb = (usb_transport_t *)tp;
+    libusb_device *dev = libusb_get_device(usb->handle);
+    usb_open_t *opened;
+
+    pthread_mutex_lock(&usb_lock);
+    if ((opened = usb_find_opened(dev)) != NULL) {
+        libusb_unref_device(opened->dev);
+        opened->dev = NULL;
+    }
+    pthread_mutex_unlock(&usb_lock);
+
+    libusb_close(usb->handle);
+    free(usb);
+
+    // Balances the libusb_init() in usb_open()
+    libusb_exit(NULL);
+}
+
+static void
+usb_xfer_done(struct libusb_transfer *transfer)
+{
+    cab_xfer_t *xfer = transfer->user_data;
+    bool out = transfer == xfer->priv[0];
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        fprintf(stderr, "libusb transfer(%s) failed with status %d\n",
+          out ? "out" : "in", transfer->status);
+        exit(EXIT_FAILURE);
+    }
+
+    if (out && transfer->actual_length != transfer->length) {
+        fprintf(stderr, "libusb transfer(out): "
+          "requested %d bytes but %d transferred\n",
+          transfer->length, transfer->actual_length);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!out) {
+        xfer->actual_inl = transfer->actual_length;
+    }
+
+    if (--xfer->pending == 0) {
+        xfer->done = 1;
+    }
+}
+
+static void
+usb_submit_one(usb_transport_t *usb, cab_xfer_t *xfer, int which,
+  unsigned char endpoint, uint8_t *buf, int len)
+{
+    int rc;
+
+    if (xfer->priv[which] == NULL) {
+        if ((xfer->priv[which] = libusb_alloc_transfer(0)) == NULL) {
+            fprintf(stderr, "libusb_alloc_transfer() failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    libusb_fill_bulk_transfer(xfer->priv[which], usb->handle, endpoint,
+      buf, len, usb_xfer_done, xfer, USB_TIMEOUT);
+
+    rc = libusb_submit_transfer(xfer->priv[which]);
+    usb_errchk(which == 0 ?
+      "libusb_submit_transfer(out)" : "libusb_submit_transfer(in)", rc);
+}
+
+static void
+usb_submit(cab_transport_t *tp, cab_xfer_t *xfer)
+{
+    usb_transport_t *usb = (usb_transport_t *)tp;
+
+    xfer->actual_inl = 0;
+    xfer->done = 0;
+    xfer->pending = (xfer->outl > 0) + (xfer->inl > 0);
+
+    if (xfer->pending == 0) {
+        xfer->done = 1;
+    }
+
+    if (xfer->outl > 0) {
+        usb_submit_one(usb, xfer, 0, LIBUSB_ENDPOINT_OUT|1,
+          xfer->out, xfer->outl);
+    }
+
+    if (xfer->inl > 0) {
+        usb_submit_one(usb, xfer, 1, LIBUSB_ENDPOINT_IN|1,
+          xfer->in, xfer->inl);
+    }
+}
+
+static void
+usb_wait(cab_transport_t *tp, cab_xfer_t *xfer)
+{
+    int rc;
+
+    while (!xfer->done) {
+        rc = libusb_handle_events_completed(NULL, &xfer->done);
+        if (rc != LIBUSB_ERROR_INTERRUPTED) {
+            usb_errchk("libusb_handle_events_completed()", rc);
+        }
+    }
+}
+
+static void
+usb_release(cab_transport_t *tp, cab_xfer_t *xfer)
+{
+    for (int i = 0; i < 2; i++) {
+        if (xfer->priv[i] != NULL) {
+            libusb_free_transfer(xfer->priv[i]);
+            xfer->priv[i] = NULL;
+        }
+    }
+}
+
+const cab_transport_ops_t cab_t48_usb_transport = {
+    "usb",
+    usb_open,
+    usb_close,
+    usb_submit,
+    usb_wait,
+    usb_enumerate,
+    usb_release,
+};
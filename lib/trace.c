@@ -0,0 +1,260 @@
+// Timeline tracer (see cabbic/trace.h).
+//
+// Events are appended to a per-thread list of fixed size chunks, so recording
+// is just a few stores.  The per-thread buffers are linked into a global list
+// with a compare-and-swap when each thread records its first event.  They are
+// only read by trace_close(), once the other threads have finished.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+
+#define TRACE_CHUNK     4096
+
+typedef struct {
+    const char *cat;
+    const char *name;
+    const char *arg;
+    long value;
+    uint64_t start;
+    uint64_t end;
+    uint32_t id;
+    char phase;         // 'X' for a complete span, 'b' for an async one
+} trace_event_t;
+
+typedef struct trace_chunk {
+    struct trace_chunk *next;
+    int nevents;
+    trace_event_t events[TRACE_CHUNK];
+} trace_chunk_t;
+
+typedef struct trace_buf {
+    struct trace_buf *next;
+    int tid;
+    const char *name;
+    trace_chunk_t *first, *last;
+} trace_buf_t;
+
+static FILE *trace_file;
+static uint64_t trace_epoch;
+static _Atomic(trace_buf_t *) trace_bufs;
+static atomic_int trace_ntids;
+static _Thread_local trace_buf_t *trace_buf;
+
+uint64_t
+trace_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool
+cab_trace_enabled()
+{
+    return trace_file != NULL;
+}
+
+static trace_buf_t *
+trace_thread_buf()
+{
+    trace_buf_t *buf = trace_buf;
+
+    if (buf) {
+        return buf;
+    }
+
+    if ((buf = calloc(1, sizeof *buf)) == NULL) {
+        return NULL;
+    }
+    buf->tid = atomic_fetch_add(&trace_ntids, 1) + 1;
+
+    buf->next = atomic_load(&trace_bufs);
+    while (!atomic_compare_exchange_weak(&trace_bufs, &buf->next, buf)) {
+    }
+
+    return trace_buf = buf;
+}
+
+static trace_event_t *
+trace_event()
+{
+    trace_buf_t *buf = trace_thread_buf();
+    trace_chunk_t *chunk;
+
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    chunk = buf->last;
+    if (chunk == NULL || chunk->nevents == TRACE_CHUNK) {
+        // Events are dropped if we run out of memory
+        if ((chunk = malloc(sizeof *chunk)) == NULL) {
+            return NULL;
+        }
+        chunk->next = NULL;
+        chunk->nevents = 0;
+        if (buf->last) {
+            buf->last->next = chunk;
+        } else {
+            buf->first = chunk;
+        }
+        buf->last = chunk;
+    }
+
+    return &chunk->events[chunk->nevents++];
+}
+
+void
+trace_thread_name(const char *name)
+{
+    trace_buf_t *buf;
+
+    if (trace_file && (buf = trace_thread_buf()) != NULL) {
+        buf->name = name;
+    }
+}
+
+cab_trace_span_t
+cab_trace_begin(const char *cat, const char *name)
+{
+    cab_trace_span_t span = { 0, cat, name };
+
+    if (trace_file) {
+        span.start = trace_now();
+    }
+
+    return span;
+}
+
+void
+cab_trace_end_arg(cab_trace_span_t *span, const char *arg, long value)
+{
+    trace_event_t *ev;
+
+    if (span->start == 0 || (ev = trace_event()) == NULL) {
+        return;
+    }
+
+    ev->cat = span->cat;
+    ev->name = span->name;
+    ev->arg = arg;
+    ev->value = value;
+    ev->start = span->start;
+    ev->end = trace_now();
+    ev->phase = 'X';
+}
+
+void
+cab_trace_end(cab_trace_span_t *span)
+{
+    cab_trace_end_arg(span, NULL, 0);
+}
+
+void
+trace_async(const char *cat, const char *name, uint32_t id,
+  uint64_t start, const char *arg, long value)
+{
+    trace_event_t *ev;
+
+    if (trace_file == NULL || (ev = trace_event()) == NULL) {
+        return;
+    }
+
+    ev->cat = cat;
+    ev->name = name;
+    ev->arg = arg;
+    ev->value = value;
+    ev->start = start;
+    ev->end = trace_now();
+    ev->id = id;
+    ev->phase = 'b';
+}
+
+void
+trace_open(const char *path)
+{
+    if ((trace_file = fopen(path, "w")) == NULL) {
+        perror(path);
+        return;
+    }
+
+    trace_epoch = trace_now();
+    trace_thread_name("app");
+}
+
+static void
+trace_write_event(trace_buf_t *buf, trace_event_t *ev, bool *first)
+{
+    double start = (ev->start - trace_epoch) / 1e3;
+    double end = (ev->end - trace_epoch) / 1e3;
+    char args[96] = "";
+
+    if (ev->arg) {
+        snprintf(args, sizeof args, ",\"args\":{\"%s\":%ld}",
+          ev->arg, ev->value);
+    }
+
+    if (ev->phase == 'X') {
+        fprintf(trace_file, "%s\n{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\","
+          "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f%s}",
+          *first ? "" : ",", ev->cat, ev->name, buf->tid,
+          start, end - start, args);
+    } else {
+        fprintf(trace_file, "%s\n{\"ph\":\"b\",\"cat\":\"%s\",\"name\":\"%s\","
+          "\"pid\":1,\"tid\":%d,\"id\":%u,\"ts\":%.3f%s}",
+          *first ? "" : ",", ev->cat, ev->name, buf->tid, ev->id,
+          start, args);
+        fprintf(trace_file, ",\n{\"ph\":\"e\",\"cat\":\"%s\",\"name\":\"%s\","
+          "\"pid\":1,\"tid\":%d,\"id\":%u,\"ts\":%.3f}",
+          ev->cat, ev->name, buf->tid, ev->id, end);
+    }
+
+    *first = false;
+}
+
+void
+trace_close()
+{
+    trace_buf_t *buf, *next_buf;
+    trace_chunk_t *chunk, *next_chunk;
+    bool first = true;
+
+    if (trace_file == NULL) {
+        return;
+    }
+
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (buf = atomic_load(&trace_bufs); buf; buf = next_buf) {
+        next_buf = buf->next;
+
+        if (buf->name) {
+            fprintf(trace_file, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\","
+              "\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+              first ? "" : ",", buf->tid, buf->name);
+            first = false;
+        }
+
+        for (chunk = buf->first; chunk; chunk = next_chunk) {
+            next_chunk = chunk->next;
+            for (int i = 0; i < chunk->nevents; i++) {
+                trace_write_event(buf, &chunk->events[i], &first);
+            }
+            free(chunk);
+        }
+
+        free(buf);
+    }
+
+    fprintf(trace_file, "\n]}\n");
+    fclose(trace_file);
+
+    trace_file = NULL;
+    atomic_store(&trace_bufs, NULL);
+}
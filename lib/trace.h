@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cabbic/trace.h>
+
+// Hooks through which the core drives the tracer in cabbic/trace.h
+
+void trace_open(const char *path);
+void trace_close();
+
+// Name the calling thread in the trace
+void trace_thread_name(const char *name);
+
+// Record a span which may overlap others on the same thread, such as a
+// message which is in flight while the app carries on.
+void trace_async(const char *cat, const char *name, uint32_t id,
+  uint64_t start, const char *arg, long value);
+
+uint64_t trace_now();
+
+// Trace a function from here until it returns
+#define TRACE_FUNCTION(cat) \
+    cab_trace_span_t trace_span __attribute__((cleanup(cab_trace_end))) = \
+      cab_trace_begin(cat, __func__)
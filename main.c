@@ -1,25 +1,29 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <libusb.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include <cabbic/api.h>
+#include <cabbic/t48.h>
+#include <cabbic/transport.h>
+#include <cabbic/stats.h>
+#include "lib/stats.h"
+#include "lib/trace.h"
 
-#define T48_USB_VID 0xA466
-#define T48_USB_PID 0x0A53
-#define T48_DEVTYPE 7
+// Account for a call to a public API function, and trace it until it returns
+#define API_CALL(api) \
+    TRACE_FUNCTION("api"); \
+    stats_api_enter(&ctx->stats, api)
 
-// 40 ZIF pins plus 16 on front-facing jumper connector
-#define T48_MAX_PINS        56
+// Upper limit for the number of messages which may be in flight at once
+#define USB_QUEUE_MAX       16
 
-#define T48_CMD_QUERY       0x00
-#define T48_CONFIG_AND_READ 0x28
-#define T48_RESET_PINS      0x2D
-#define T48_SET_VCC_PINS    0x2E
-#define T48_SET_VPP_PINS    0x2F
-#define T48_SET_GND_PINS    0x30
-
-#define USB_TIMEOUT 5000
+// Longest delay which cab_delay_at_least() makes by padding a batch
+#define DELAY_PAD_MAX       (4 * T48_MAX_VECTORS)
 
 typedef struct {
     bool supported;
@@ -27,21 +31,113 @@ typedef struct {
     uint8_t bit;
 } pin_msg_info_t;
 
-static cab_pin_mode_e io_pin_modes[T48_MAX_PINS];
-
-static libusb_device_handle *usb_handle;
-static bool device_never_reset = true;
-static bool hold = false;
-static bool pullup = false;
+// A request to return pin values sampled by a particular vector
+typedef struct {
+    uint8_t *pins;
+    uint8_t *values;
+    int npins;
+    uint8_t *raw;   // If not NULL, receives the whole sampled vector
+    int vector;
+    bool *done;     // If not NULL, set once the results have been filled in
+} vector_read_t;
+
+// Results of reads queued by cab_io_read_async().  These are allocated in
+// fixed chunks which never move, since in-flight reads point into them.
+#define TICKET_CHUNK        256
 
-static void
-usb_errchk(const char *what, int err)
-{
-    if (err < 0) {
-        fprintf(stderr, "%s: %s\n", what, libusb_error_name(err));
-        exit(EXIT_FAILURE);
-    }
-}
+typedef struct {
+    uint8_t pins[T48_VECTOR_PINS];
+    uint8_t raw[T48_VECTOR_BYTES];
+    uint8_t npins;
+    bool ready;
+} ticket_t;
+
+// A message which has been handed to the transport, or to the I/O thread.
+// Slots form a ring, and are always retired in the order they were submitted.
+typedef struct {
+    cab_xfer_t xfer;
+    uint8_t out[T48_VECTOR_MSG_MAX];
+    uint8_t in[T48_VECTOR_MSG_MAX];
+    bool vectors;   // This is a CONFIG_AND_READ message
+    uint8_t cmd;
+    bool alone;     // Nothing else was in flight when this was submitted
+    uint32_t seq;
+    uint64_t submitted;
+    int nreads;
+    vector_read_t reads[T48_MAX_VECTORS];
+} usb_slot_t;
+
+// Single-producer, single-consumer ring of slot indices.  When the I/O thread
+// is running, the app thread produces commands and consumes replies, and the
+// I/O thread does the reverse.  Since no more than USB_QUEUE_MAX slots can be
+// in flight, the rings never overflow.
+typedef struct {
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    uint8_t entries[USB_QUEUE_MAX];
+} spsc_ring_t;
+
+// Everything about one T48.  The fields used on every commit come first, so
+// they share as few cache lines as possible.
+struct cab_ctx {
+    // Pending IO pin modes, kept in the wire format used by CONFIG_AND_READ
+    uint8_t io_vector[T48_VECTOR_BYTES];
+
+    // Wire-format copy of the last vector committed, used to skip commits
+    // which wouldn't change anything.
+    uint8_t shadow_vector[T48_VECTOR_BYTES];
+    bool shadow_valid;
+    bool shadow_pullup;
+
+    bool device_never_reset;
+    bool hold;
+    bool pullup;
+    bool io_thread;
+
+    // Vectors committed during cab_io_batch_begin()/cab_io_batch_end() are
+    // accumulated in batch_vectors until a full message's worth is ready.
+    bool batch_pullup;
+    int batch_depth;
+    int batch_nvectors, batch_nreads;
+
+    int usb_queue_depth;
+    int slot_first, slot_count;
+    uint32_t slot_seq;
+    cab_transport_t *transport;
+    unsigned long commits_skipped;
+
+    uint8_t batch_vectors[T48_MAX_VECTORS][T48_VECTOR_BYTES];
+    vector_read_t batch_reads[T48_MAX_VECTORS];
+
+    ticket_t **ticket_chunks;
+    int ticket_nchunks;
+    cab_ticket_t ticket_count;
+
+    spsc_ring_t cmd_ring, reply_ring;
+    atomic_bool io_thread_run;
+    pthread_t io_thread_id;
+
+    stats_t stats;
+    cab_serial_t serial;
+
+    // When the T48 is taken to have acted on the last message, and the minimum
+    // time it takes to apply a vector (0 if unknown), for cab_delay_at_least()
+    uint64_t last_applied;
+    unsigned long vector_period;
+
+    usb_slot_t usb_slots[USB_QUEUE_MAX];
+};
+
+// Transports which can be selected with the CABBIC_TRANSPORT environment
+// variable (optionally followed by ":serial").  The first is the default.
+static const cab_transport_ops_t *transports[] = {
+    &cab_t48_usb_transport,
+    &cab_t48_sim_transport,
+    &cab_t48_daemon_transport,
+};
+
+// The context used by the cab_*() functions which don't take one
+static cab_ctx_t *default_ctx;
 
 const char *
 cab_sterror(cab_err_e err)
@@ -70,6 +166,9 @@ cab_sterror(cab_err_e err)
         case CAB_ERR_IO:
             return "Input/Output Error";
             break;
+        case CAB_ERR_NO_MEMORY:
+            return "Out Of Memory";
+            break;
         default:
             return "Unknown Error";
             break;
@@ -77,78 +176,281 @@ cab_sterror(cab_err_e err)
 }
 
 static void
-usb_open()
+ring_push(spsc_ring_t *ring, uint8_t entry)
 {
-    libusb_device **list, *dev, *found = NULL;
-    ssize_t ndevices = libusb_get_device_list(NULL, &list);
-    int rc;
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
 
-    usb_errchk("libusb_get_device_list()", ndevices);
+    ring->entries[head % USB_QUEUE_MAX] = entry;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
 
-    for (int i = 0; i < ndevices; i++) {
-        dev = list[i];
-        if (dev == NULL) {
-            break;
+static bool
+ring_pop(spsc_ring_t *ring, uint8_t *entry)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        return false;
+    }
+
+    *entry = ring->entries[tail % USB_QUEUE_MAX];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+// Called while polling an empty ring: spin at first, since a reply or the
+// next command is usually imminent, then back off so an idle thread doesn't
+// hog a CPU.
+static void
+ring_backoff(int *spins)
+{
+    if (++*spins < 1000) {
+        return;
+    } else if (*spins < 2000) {
+        sched_yield();
+    } else {
+        usleep(50);
+    }
+}
+
+// The I/O thread hands everything it has been given to the transport before
+// waiting for the oldest, so that exchanges can overlap.
+static void *
+io_thread_main(void *arg)
+{
+    cab_ctx_t *ctx = arg;
+    uint8_t inflight[USB_QUEUE_MAX];
+    int first = 0, count = 0, spins = 0;
+    uint8_t index;
+
+    trace_thread_name("usb-io");
+
+    for (;;) {
+        while (ring_pop(&ctx->cmd_ring, &index)) {
+            cab_trace_span_t span = cab_trace_begin("transport", "submit");
+            cab_transport_t *tp = ctx->transport;
+            tp->ops->submit(tp, &ctx->usb_slots[index].xfer);
+            cab_trace_end(&span);
+            inflight[(first + count++) % USB_QUEUE_MAX] = index;
         }
-        
-		struct libusb_device_descriptor desc;
-		rc = libusb_get_device_descriptor(dev, &desc);
-        usb_errchk("libusb_get_device_descriptor()", rc);
 
-        if (desc.idVendor == T48_USB_VID && desc.idProduct == T48_USB_PID) {
-            found = dev;
+        if (count > 0) {
+            cab_trace_span_t span = cab_trace_begin("transport", "wait");
+            index = inflight[first];
+            ctx->transport->ops->wait(ctx->transport,
+              &ctx->usb_slots[index].xfer);
+            cab_trace_end(&span);
+            first = (first + 1) % USB_QUEUE_MAX;
+            count--;
+            ring_push(&ctx->reply_ring, index);
+            spins = 0;
+        } else if (!atomic_load(&ctx->io_thread_run)) {
             break;
+        } else {
+            ring_backoff(&spins);
         }
     }
 
-    if (found == NULL) {
-        fprintf(stderr, "No T48 detected\n");
-        exit(EXIT_FAILURE);
+    return NULL;
+}
+
+static void
+usb_submit(cab_ctx_t *ctx, usb_slot_t *slot)
+{
+    if (ctx->io_thread) {
+        ring_push(&ctx->cmd_ring, slot - ctx->usb_slots);
+    } else {
+        ctx->transport->ops->submit(ctx->transport, &slot->xfer);
+    }
+}
+
+static cab_err_e batch_flush(cab_ctx_t *ctx, bool wait);
+static cab_err_e vector_reply(usb_slot_t *slot);
+
+// Wait for the oldest in-flight message to complete, and process its reply.
+static cab_err_e
+usb_reap(cab_ctx_t *ctx)
+{
+    usb_slot_t *slot = &ctx->usb_slots[ctx->slot_first];
+    cab_trace_span_t span = cab_trace_begin("usb", "wait");
+    uint64_t wait_start = stats_now(), wait_end;
+    uint8_t index;
+    int spins = 0;
+
+    if (ctx->io_thread) {
+        while (!ring_pop(&ctx->reply_ring, &index)) {
+            ring_backoff(&spins);
+        }
     } else {
-        rc = libusb_open(dev, &usb_handle);
-        usb_errchk("libusb_open()", rc);
+        ctx->transport->ops->wait(ctx->transport, &slot->xfer);
     }
 
-    libusb_free_device_list(list, 1);
+    cab_trace_end(&span);
+    wait_end = stats_now();
+    stats_exchange(&ctx->stats, slot->cmd, slot->xfer.actual_inl,
+      slot->submitted, wait_start, wait_end);
+
+    // The T48 acted on the message at some point during the round trip.  If
+    // it had the link to itself, the outbound half can be counted towards a
+    // delay, but otherwise it may have been queued behind other messages.
+    ctx->last_applied = slot->alone ?
+      slot->submitted + (wait_end - slot->submitted) / 2 : wait_end;
+    trace_async("usb", stats_cmd_name(slot->cmd), slot->seq, slot->submitted,
+      "bytes", slot->xfer.outl);
+
+    ctx->slot_first = (ctx->slot_first + 1) % USB_QUEUE_MAX;
+    ctx->slot_count--;
+
+    return slot->vectors ? vector_reply(slot) : CAB_ERR_NONE;
 }
 
-static int
-transact(uint8_t *out, int outl, uint8_t *in, int inl)
+// Retire every in-flight message, returning the first error encountered.
+static cab_err_e
+usb_drain(cab_ctx_t *ctx)
 {
-    int rc, nbytes;
+    cab_err_e err, first_err = CAB_ERR_NONE;
 
-    if (out && outl > 0) {
-        rc = libusb_bulk_transfer(usb_handle, LIBUSB_ENDPOINT_OUT|1, out,
-           outl, &nbytes, USB_TIMEOUT);
-        usb_errchk("libusb_bulk_transfer(out)", rc);
-        if (nbytes != outl) {
-            fprintf(stderr, "libusb_bulk_transfer(out): "
-              "requested %d bytes but %d transferred\n",
-              outl, nbytes);
-            exit(EXIT_FAILURE);
+    while (ctx->slot_count > 0) {
+        err = usb_reap(ctx);
+        if (err != CAB_ERR_NONE && first_err == CAB_ERR_NONE) {
+            first_err = err;
+        }
+    }
+
+    return first_err;
+}
+
+// Return the next free slot, waiting for the oldest message to complete if
+// the queue is full.
+static cab_err_e
+usb_slot_alloc(cab_ctx_t *ctx, usb_slot_t **slot)
+{
+    cab_err_e err;
+
+    if (ctx->slot_count == ctx->usb_queue_depth) {
+        if ((err = usb_reap(ctx)) != CAB_ERR_NONE) {
+            return err;
         }
     }
 
-    if (in && inl > 0) {
-        rc = libusb_bulk_transfer(usb_handle, LIBUSB_ENDPOINT_IN|1, in,
-           inl, &nbytes, USB_TIMEOUT);
-        usb_errchk("libusb_bulk_transfer(in)", rc);
+    *slot = &ctx->usb_slots[
+      (ctx->slot_first + ctx->slot_count) % USB_QUEUE_MAX];
+
+    return CAB_ERR_NONE;
+}
+
+static void
+usb_slot_queue(cab_ctx_t *ctx, usb_slot_t *slot, int outl, int inl,
+  bool vectors)
+{
+    slot->xfer.out = slot->out;
+    slot->xfer.outl = outl;
+    slot->xfer.in = slot->in;
+    slot->xfer.inl = inl;
+    slot->vectors = vectors;
+
+    slot->cmd = outl > 0 ? slot->out[0] : 0xff;
+    stats_message(&ctx->stats, slot->cmd, vectors ? slot->out[4] : 0, outl);
+    slot->seq = ctx->slot_seq++;
+    slot->submitted = stats_now();
+    slot->alone = ctx->slot_count == 0;
+
+    usb_submit(ctx, slot);
+    ctx->slot_count++;
+}
+
+// Send one message and wait for its reply.  Returns an error reported by any
+// message which was still in flight, e.g. an overcurrent found by a vector
+// message, since this is the caller's only chance to hear about it.
+static cab_err_e
+transact(cab_ctx_t *ctx, uint8_t *out, int outl, uint8_t *in, int inl)
+{
+    TRACE_FUNCTION("usb");
+    usb_slot_t *slot;
+    cab_err_e err, drain_err;
+
+    // Anything still in flight must be sent before this message
+    drain_err = usb_drain(ctx);
+    if ((err = usb_slot_alloc(ctx, &slot)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    if (out && outl > 0) {
+        memcpy(slot->out, out, outl);
     } else {
-        nbytes = 0;
+        outl = 0;
+    }
+
+    if (!in || inl < 0) {
+        inl = 0;
+    }
+
+    usb_slot_queue(ctx, slot, outl, inl, false);
+    err = usb_drain(ctx);
+
+    if (inl > 0) {
+        memcpy(in, slot->in, slot->xfer.actual_inl);
+    }
+
+    return drain_err != CAB_ERR_NONE ? drain_err : err;
+}
+
+cab_err_e
+cab_ctx_io_thread_start(cab_ctx_t *ctx)
+{
+    cab_err_e err;
+
+    API_CALL(CAB_STATS_API_BATCH);
+
+    if (ctx->io_thread) {
+        return CAB_ERR_STATE;
+    }
+
+    err = usb_drain(ctx);
+
+    atomic_store(&ctx->io_thread_run, true);
+    if (pthread_create(&ctx->io_thread_id, NULL, io_thread_main, ctx) != 0) {
+        fprintf(stderr, "Failed to create I/O thread\n");
+        atomic_store(&ctx->io_thread_run, false);
+        return CAB_ERR_IO;
+    }
+
+    ctx->io_thread = true;
+
+    return err;
+}
+
+cab_err_e
+cab_ctx_io_thread_stop(cab_ctx_t *ctx)
+{
+    cab_err_e err;
+
+    API_CALL(CAB_STATS_API_BATCH);
+
+    if (!ctx->io_thread) {
+        return CAB_ERR_STATE;
     }
 
-    return nbytes;
+    err = batch_flush(ctx, true);
+
+    atomic_store(&ctx->io_thread_run, false);
+    pthread_join(ctx->io_thread_id, NULL);
+
+    ctx->io_thread = false;
+
+    return err;
 }
 
 static void
-init_t48(int verbose)
+init_t48(cab_ctx_t *ctx, int verbose)
 {
     char buf[64];
     uint8_t msg[80];
     memset(msg, 0, sizeof msg);
 
     msg[0] = T48_CMD_QUERY;
-    transact(msg, 5, msg, sizeof msg);
+    transact(ctx, msg, 5, msg, sizeof msg);
 
     if (msg[6] != T48_DEVTYPE) {
         fprintf(stderr,
@@ -156,6 +458,9 @@ init_t48(int verbose)
         exit(EXIT_FAILURE);
     }
 
+    memset(ctx->serial, 0, sizeof ctx->serial);
+    memcpy(ctx->serial, &msg[T48_SERIAL_OFFSET], T48_SERIAL_LEN);
+
     if (!verbose) {
         return;
     }
@@ -197,7 +502,7 @@ init_t48(int verbose)
 }
 
 static cab_err_e
-set_pins(uint8_t *pins, int npins,
+set_pins(cab_ctx_t *ctx, uint8_t *pins, int npins,
   int voltage, pin_msg_info_t *pin_info, uint8_t msgtype, const char *pintype)
 {
     uint8_t msg[48];
@@ -219,13 +524,11 @@ set_pins(uint8_t *pins, int npins,
 
     msg[22] = voltage;
 
-    transact(msg, sizeof msg, NULL, 0);
-
-    return CAB_ERR_NONE;
+    return transact(ctx, msg, sizeof msg, NULL, 0);
 }
 
 static int
-set_vpp_voltage(float voltage)
+set_vpp_voltage(cab_ctx_t *ctx, float voltage)
 {
     const float vpp_min = 9.0, vpp_max = 25.0;
 
@@ -242,15 +545,22 @@ set_vpp_voltage(float voltage)
     msg[0] = T48_SET_VPP_PINS;
     msg[1] = 1;         // Set VPP voltage
     msg[8] = v;
-    transact(msg, sizeof msg, NULL, 0);
 
-    return CAB_ERR_NONE;
+    return transact(ctx, msg, sizeof msg, NULL, 0);
 }
 
 cab_err_e
-cab_set_io_voltage(float voltage)
+cab_ctx_set_io_voltage(cab_ctx_t *ctx, float voltage)
 {
     const float vpp_min = 2.35, vpp_max = 3.45;
+    cab_err_e err;
+
+    API_CALL(CAB_STATS_API_SET_VOLTAGE);
+
+    // Vectors which are still batched must reach the device first
+    if ((err = batch_flush(ctx, true)) != CAB_ERR_NONE) {
+        return err;
+    }
 
     // Map voltage to the range [0, 63]
     int v = (voltage - vpp_min) / (vpp_max - vpp_min) * 4 + 0.5;
@@ -265,13 +575,12 @@ cab_set_io_voltage(float voltage)
     msg[0] = T48_SET_VPP_PINS;
     msg[1] = 2;         // Set IO voltage
     msg[8] = v;
-    transact(msg, sizeof msg, NULL, 0);
 
-    return CAB_ERR_NONE;
+    return transact(ctx, msg, sizeof msg, NULL, 0);
 }
 
 static int
-set_vpp_pins(uint8_t *pins, int npins, float voltage)
+set_vpp_pins(cab_ctx_t *ctx, uint8_t *pins, int npins, float voltage)
 {
     static pin_msg_info_t pin_info[] = {
         { 1, 0, 7 },    // 1
@@ -333,16 +642,16 @@ set_vpp_pins(uint8_t *pins, int npins, float voltage)
     };
 
     cab_err_e err;
-    if ((err = set_pins(pins, npins, 0,
+    if ((err = set_pins(ctx, pins, npins, 0,
       pin_info, T48_SET_VPP_PINS, "VPP")) != CAB_ERR_NONE) {
         return err;
     }
 
-    return set_vpp_voltage(voltage);
+    return set_vpp_voltage(ctx, voltage);
 }
 
 static int
-set_vcc_pins(uint8_t *pins, int npins, float voltage)
+set_vcc_pins(cab_ctx_t *ctx, uint8_t *pins, int npins, float voltage)
 {
     static pin_msg_info_t pin_info[] = {
         { 1, 0, 0 },    // 1
@@ -413,11 +722,11 @@ set_vcc_pins(uint8_t *pins, int npins, float voltage)
         return CAB_ERR_OUT_OF_RANGE;
     }
 
-    return set_pins(pins, npins, v, pin_info, T48_SET_VCC_PINS, "VCC");
+    return set_pins(ctx, pins, npins, v, pin_info, T48_SET_VCC_PINS, "VCC");
 }
 
 static int
-set_gnd_pins(uint8_t *pins, int npins)
+set_gnd_pins(cab_ctx_t *ctx, uint8_t *pins, int npins)
 {
     static pin_msg_info_t pin_info[] = {
         { 1, 0, 7 },    // 1
@@ -478,57 +787,79 @@ set_gnd_pins(uint8_t *pins, int npins)
         { 1, 8, 2 },    // 56
     };
 
-    return set_pins(pins, npins, 0, pin_info, T48_SET_GND_PINS, "GND");
+    return set_pins(ctx, pins, npins, 0, pin_info, T48_SET_GND_PINS, "GND");
 }
 
 cab_err_e
-cab_reset(uint8_t *gnd_pins, int ngnd, uint8_t *vcc_pins, int nvcc,
-  uint8_t *vpp_pins, int nvpp, float vcc_voltage, float vpp_voltage)
+cab_ctx_reset(cab_ctx_t *ctx, uint8_t *gnd_pins, int ngnd,
+  uint8_t *vcc_pins, int nvcc, uint8_t *vpp_pins, int nvpp,
+  float vcc_voltage, float vpp_voltage)
 {
     uint8_t msg[10];
+    cab_err_e err;
+
+    API_CALL(CAB_STATS_API_RESET);
+
+    if ((err = batch_flush(ctx, true)) != CAB_ERR_NONE) {
+        return err;
+    }
+
     memset(msg, 0, sizeof msg);
 
     msg[0] = T48_RESET_PINS;
-    transact(msg, sizeof msg, NULL, 0);
+    if ((err = transact(ctx, msg, sizeof msg, NULL, 0)) != CAB_ERR_NONE) {
+        return err;
+    }
 
-    cab_err_e err;
-    if ((err = set_gnd_pins(gnd_pins, ngnd)) != CAB_ERR_NONE) {
+    if ((err = set_gnd_pins(ctx, gnd_pins, ngnd)) != CAB_ERR_NONE) {
         return err;
     }
 
-    if ((err = set_vcc_pins(vcc_pins, nvcc, vcc_voltage)) != CAB_ERR_NONE) {
+    err = set_vcc_pins(ctx, vcc_pins, nvcc, vcc_voltage);
+    if (err != CAB_ERR_NONE) {
         return err;
     }
 
     if (vpp_pins && nvpp > 0) {
-        if ((err = set_vpp_pins(vpp_pins, nvpp, vpp_voltage)) != CAB_ERR_NONE) {
+        err = set_vpp_pins(ctx, vpp_pins, nvpp, vpp_voltage);
+        if (err != CAB_ERR_NONE) {
             return err;
         }
     }
 
-    for (int i = 0; i < sizeof io_pin_modes / sizeof io_pin_modes[0]; i++) {
-        io_pin_modes[i] = CAB_PMODE_Z;
-    }
+    memset(ctx->io_vector, CAB_PMODE_Z << 4 | CAB_PMODE_Z,
+      sizeof ctx->io_vector);
+
+    // The reset leaves the IO pins in an unknown state
+    ctx->shadow_valid = false;
 
-    device_never_reset = false;
+    ctx->device_never_reset = false;
 
     return CAB_ERR_NONE;
 }
 
 cab_err_e
-cab_set_vpp_voltage(float voltage)
+cab_ctx_set_vpp_voltage(cab_ctx_t *ctx, float voltage)
 {
-    if (device_never_reset) {
+    cab_err_e err;
+
+    API_CALL(CAB_STATS_API_SET_VOLTAGE);
+
+    if (ctx->device_never_reset) {
         return CAB_ERR_STATE;
     }
 
-    return set_vpp_voltage(voltage);
+    if ((err = batch_flush(ctx, true)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    return set_vpp_voltage(ctx, voltage);
 }
 
 cab_err_e
-cab_io_pullup(bool enabled)
+cab_ctx_io_pullup(cab_ctx_t *ctx, bool enabled)
 {
-    pullup = enabled;
+    ctx->pullup = enabled;
 
     return CAB_ERR_NONE;
 }
@@ -537,135 +868,1207 @@ cab_io_pullup(bool enabled)
 // Therefore, only pins 1-40 can be used for GPIOs.  We can still use pins
 // 41-56 (the pins on the jumper connector at the front of the unit) for VPP,
 // VCC and GND, however.
-static int
-config_and_read(bool pullup, uint8_t *pins, uint8_t *values, int npins)
+static void
+set_pin_mode(cab_ctx_t *ctx, uint8_t pin, cab_pin_mode_e mode)
 {
-    uint8_t msg[32];
-    memset(msg, 0, sizeof msg);
+    if (pin >= 1 && pin <= T48_VECTOR_PINS) {
+        uint8_t i = pin - 1, shift = (i&1) ? 4 : 0;
+        ctx->io_vector[i>>1] = (ctx->io_vector[i>>1] & ~(0xf << shift)) |
+          (mode & 0xf) << shift;
+    }
+}
 
-    // Message used by official app for test vectors - lets you configure the
-    // IO pins and read them back.  Power and Ground pins are untouched by
-    // this call.
-    msg[0] = T48_CONFIG_AND_READ;
-    msg[1] = pullup ? 0x80 : 0;
-    msg[2] = 40;
-    msg[4] = 1;
+static uint8_t
+vector_pin_value(uint8_t *vector, uint8_t pin)
+{
+    pin--;
+    return (vector[pin>>1] >> ((pin&1) ? 4 : 0)) & 0xf;
+}
+
+// Port bitmasks are converted to and from the vector's 4-bit-per-pin layout
+// 16 pins (8 bytes) at a time, using shift-and-mask steps on 64-bit words.
+//
+// spread16() moves bit n of a 16-bit value to bit 4n, and compress16() does
+// the reverse.
+static uint64_t
+spread16(uint64_t x)
+{
+    x &= 0xffff;
+    x = (x | x << 24) & 0x000000ff000000ffULL;
+    x = (x | x << 12) & 0x000f000f000f000fULL;
+    x = (x | x << 6)  & 0x0303030303030303ULL;
+    x = (x | x << 3)  & 0x1111111111111111ULL;
+    return x;
+}
+
+static uint64_t
+compress16(uint64_t x)
+{
+    x &= 0x1111111111111111ULL;
+    x = (x | x >> 3)  & 0x0303030303030303ULL;
+    x = (x | x >> 6)  & 0x000f000f000f000fULL;
+    x = (x | x >> 12) & 0x000000ff000000ffULL;
+    x = (x | x >> 24) & 0xffff;
+    return x;
+}
+
+static uint64_t
+load_le(uint8_t *p, int n)
+{
+    uint64_t x = 0;
+    for (int i = 0; i < n; i++) {
+        x |= (uint64_t)p[i] << (8*i);
+    }
+    return x;
+}
+
+static void
+store_le(uint8_t *p, uint64_t x, int n)
+{
+    for (int i = 0; i < n; i++) {
+        p[i] = x >> (8*i);
+    }
+}
+
+#define VECTOR_CHUNK_LEN(c) ((c) < 2 ? 8 : T48_VECTOR_BYTES - 16)
+
+// Set the mode of every pin in 'mask' to 'mode', or, if 'values' is not
+// NULL, to CAB_PMODE_1 or CAB_PMODE_0 according to the bits in *values.
+static void
+set_port_modes(cab_ctx_t *ctx, uint64_t mask, cab_pin_mode_e mode,
+  uint64_t *values)
+{
+    for (int c = 0; c < 3; c++) {
+        uint64_t m = spread16(mask >> (16*c));
+        if (m == 0) {
+            continue;
+        }
+
+        uint64_t v = values ? spread16((*values & mask) >> (16*c)) : m * mode;
+        uint8_t *p = &ctx->io_vector[8*c];
+        uint64_t w = load_le(p, VECTOR_CHUNK_LEN(c));
+        store_le(p, (w & ~(m * 0xf)) | v, VECTOR_CHUNK_LEN(c));
+    }
+}
 
-    for (int i = 0; i < 40; i++) {
-        msg[8 + (i>>1)] |= (io_pin_modes[i] & 0xf) << ((i&1) ? 4 : 0);
+static uint64_t
+vector_to_port(uint8_t *vector)
+{
+    uint64_t port = 0;
+
+    for (int c = 0; c < 3; c++) {
+        uint64_t w = load_le(&vector[8*c], VECTOR_CHUNK_LEN(c));
+        port |= compress16(w) << (16*c);
     }
 
-    transact(msg, sizeof msg, msg, sizeof msg);
+    return port;
+}
+
+static cab_err_e
+vector_reply(usb_slot_t *slot)
+{
+    uint8_t *msg = slot->in;
 
     if (msg[1]) {
         fprintf(stderr, "Overcurrent protection triggered!\n");
         return CAB_ERR_OVERCURRENT;
     }
 
-    if (npins > 0 && (pins == NULL || values == NULL)) {
-        fprintf(stderr, "Bad pointer(s) passed to config_and_read()\n");
-        return CAB_ERR_BAD_POINTER;
-    }
+    for (int r = 0; r < slot->nreads; r++) {
+        vector_read_t *rd = &slot->reads[r];
 
-    for (int i = 0; i < npins; i++) {
-        uint8_t pin = pins[i] - 1;
-        values[i] = (msg[8+(pin>>1)] >> ((pin&1) ? 4 : 0)) & 0xf;
-    }
+        if (rd->npins > 0 && (rd->pins == NULL || rd->values == NULL)) {
+            fprintf(stderr, "Bad pointer(s) passed to config_and_read()\n");
+            return CAB_ERR_BAD_POINTER;
+        }
+
+        uint8_t *vector = &msg[8 + rd->vector * T48_VECTOR_BYTES];
+        for (int i = 0; i < rd->npins; i++) {
+            rd->values[i] = vector_pin_value(vector, rd->pins[i]);
+        }
+
+        if (rd->raw) {
+            memcpy(rd->raw, vector, T48_VECTOR_BYTES);
+        }
 
-    hold = false;
+        if (rd->done) {
+            *rd->done = true;
+        }
+    }
 
     return CAB_ERR_NONE;
 }
 
-cab_err_e
-cab_io_hold_on()
+// Send a CONFIG_AND_READ message.  Unless 'wait' is set (or the queue depth
+// is 1), this returns as soon as the message has been queued, and the reads
+// are completed when the reply is retired by usb_reap().
+static cab_err_e
+config_and_read(cab_ctx_t *ctx, bool with_pullup,
+  uint8_t (*vectors)[T48_VECTOR_BYTES], int nvectors,
+  vector_read_t *reads, int nreads, bool wait)
 {
-    if (device_never_reset) {
-        return CAB_ERR_STATE;
+    cab_err_e err;
+    int msglen = 8 + nvectors * T48_VECTOR_BYTES;
+    usb_slot_t *slot;
+
+    if ((err = usb_slot_alloc(ctx, &slot)) != CAB_ERR_NONE) {
+        return err;
     }
 
-    hold = true;
+    uint8_t *msg = slot->out;
+
+    // Single vector messages are padded to the size the official app uses
+    if (msglen < 32) {
+        msglen = 32;
+    }
+    memset(msg, 0, msglen);
+
+    // Message used by official app for test vectors - lets you configure the
+    // IO pins and read them back.  Power and Ground pins are untouched by
+    // this call.
+    msg[0] = T48_CONFIG_AND_READ;
+    msg[1] = with_pullup ? 0x80 : 0;
+    msg[2] = T48_VECTOR_PINS;
+    msg[4] = nvectors;
+    memcpy(&msg[8], vectors, nvectors * T48_VECTOR_BYTES);
+
+    memcpy(slot->reads, reads, nreads * sizeof *reads);
+    slot->nreads = nreads;
+
+    usb_slot_queue(ctx, slot, msglen, msglen, true);
+
+    if (wait || ctx->usb_queue_depth == 1) {
+        return usb_drain(ctx);
+    }
 
     return CAB_ERR_NONE;
 }
 
-cab_err_e
-cab_io_hold_off()
+static cab_err_e
+batch_flush(cab_ctx_t *ctx, bool wait)
 {
-    if (device_never_reset) {
-        return CAB_ERR_STATE;
+    cab_err_e err = CAB_ERR_NONE;
+
+    if (ctx->batch_nvectors > 0) {
+        err = config_and_read(ctx, ctx->batch_pullup, ctx->batch_vectors,
+          ctx->batch_nvectors, ctx->batch_reads, ctx->batch_nreads, wait);
+
+        ctx->batch_nvectors = 0;
+        ctx->batch_nreads = 0;
+    }
+
+    if (wait && err == CAB_ERR_NONE) {
+        err = usb_drain(ctx);
     }
 
-    return config_and_read(pullup, NULL, NULL, 0);
+    return err;
 }
 
-cab_err_e
-cab_io_pin_modes(uint8_t *pins, cab_pin_mode_e *modes, int npins)
+// Apply the current pin modes by appending a vector to the current batch, and
+// arrange for the pins described by 'read' (if not NULL) to be read back.
+// Outside of a batch, the vector is sent straight away along with anything
+// accumulated before it, unless this is a deferred read (i.e. 'read->done' is
+// set), in which case it waits to share a message with whatever follows.
+static cab_err_e
+commit(cab_ctx_t *ctx, vector_read_t *read)
 {
-    if (device_never_reset) {
-        return CAB_ERR_STATE;
+    bool deferred = read && read->done;
+    bool sync = ctx->batch_depth == 0 && !deferred;
+    cab_err_e err;
+
+    ctx->hold = false;
+
+    if (read && read->npins > 0 &&
+      (read->pins == NULL || read->values == NULL)) {
+        fprintf(stderr, "Bad pointer(s) passed to commit()\n");
+        return CAB_ERR_BAD_POINTER;
     }
 
-    for (int i = 0; i < npins; i++) {
-        if (pins[i] > T48_MAX_PINS) {
-            return CAB_ERR_OUT_OF_RANGE;
+    // Nothing to do if the pins are already in the requested state, and
+    // nothing needs to be read back.
+    if (read == NULL && ctx->shadow_valid &&
+      ctx->shadow_pullup == ctx->pullup && memcmp(ctx->io_vector,
+      ctx->shadow_vector, sizeof ctx->io_vector) == 0) {
+        ctx->commits_skipped++;
+        return CAB_ERR_NONE;
+    }
+
+    // The pullup setting applies to a whole message
+    if (ctx->batch_nvectors > 0 && ctx->batch_pullup != ctx->pullup) {
+        if ((err = batch_flush(ctx, false)) != CAB_ERR_NONE) {
+            return err;
         }
     }
 
-    for (int i = 0; i < npins; i++) {
-        io_pin_modes[pins[i]-1] = modes[i];
+    ctx->batch_pullup = ctx->pullup;
+    memcpy(ctx->batch_vectors[ctx->batch_nvectors], ctx->io_vector,
+      sizeof ctx->io_vector);
+
+    ctx->shadow_valid = true;
+    ctx->shadow_pullup = ctx->pullup;
+    memcpy(ctx->shadow_vector, ctx->io_vector, sizeof ctx->io_vector);
+
+    if (read) {
+        read->vector = ctx->batch_nvectors;
+        ctx->batch_reads[ctx->batch_nreads++] = *read;
     }
 
-    if (!hold) {
-        return config_and_read(pullup, NULL, NULL, 0);
+    if (++ctx->batch_nvectors == T48_MAX_VECTORS || sync) {
+        return batch_flush(ctx, sync && read);
     }
 
     return CAB_ERR_NONE;
 }
 
 cab_err_e
-cab_io_pin_mode(uint8_t pin, cab_pin_mode_e mode)
+cab_ctx_io_batch_begin(cab_ctx_t *ctx)
 {
-    if (device_never_reset) {
+    if (ctx->device_never_reset) {
         return CAB_ERR_STATE;
     }
 
-    if (pin > T48_MAX_PINS) {
-        return CAB_ERR_OUT_OF_RANGE;
-    }
-
-    io_pin_modes[pin-1] = mode;
-
-    if (!hold) {
-        return config_and_read(pullup, NULL, NULL, 0);
-    }
+    ctx->batch_depth++;
 
     return CAB_ERR_NONE;
 }
 
 cab_err_e
-cab_io_read(uint8_t *pins, uint8_t *values, int npins)
+cab_ctx_io_batch_flush(cab_ctx_t *ctx)
 {
-    if (device_never_reset) {
+    API_CALL(CAB_STATS_API_BATCH);
+
+    if (ctx->device_never_reset) {
         return CAB_ERR_STATE;
     }
 
-    return config_and_read(pullup, pins, values, npins);
+    return batch_flush(ctx, true);
 }
 
-int
-main(int argc, char **argv)
+cab_err_e
+cab_ctx_set_queue_depth(cab_ctx_t *ctx, int depth)
 {
-    int rc;
+    API_CALL(CAB_STATS_API_BATCH);
 
-	rc = libusb_init(NULL);
-    usb_errchk("libusb_init()", rc);
+    if (depth < 1 || depth > USB_QUEUE_MAX) {
+        return CAB_ERR_OUT_OF_RANGE;
+    }
 
-    usb_open();
+    cab_err_e err = batch_flush(ctx, true);
 
-    init_t48(true);
+    ctx->usb_queue_depth = depth;
 
-    rc = app_run(argc, argv);
+    return err;
+}
+
+cab_err_e
+cab_ctx_io_batch_end(cab_ctx_t *ctx)
+{
+    API_CALL(CAB_STATS_API_BATCH);
+
+    if (ctx->batch_depth == 0) {
+        return CAB_ERR_STATE;
+    }
+
+    if (--ctx->batch_depth > 0) {
+        return CAB_ERR_NONE;
+    }
+
+    return batch_flush(ctx, true);
+}
+
+cab_err_e
+cab_ctx_io_vector_period(cab_ctx_t *ctx, unsigned long ns)
+{
+    ctx->vector_period = ns;
+
+    return CAB_ERR_NONE;
+}
+
+// Append 'n' copies of the last committed vector to the batch, so the T48
+// holds the pins where they are for 'n' vector periods.
+static cab_err_e
+batch_pad(cab_ctx_t *ctx, int n)
+{
+    cab_err_e err;
+
+    while (n-- > 0) {
+        memcpy(ctx->batch_vectors[ctx->batch_nvectors], ctx->shadow_vector,
+          sizeof ctx->shadow_vector);
+
+        if (++ctx->batch_nvectors == T48_MAX_VECTORS) {
+            if ((err = batch_flush(ctx, false)) != CAB_ERR_NONE) {
+                return err;
+            }
+        }
+    }
+
+    return CAB_ERR_NONE;
+}
+
+unsigned long
+cab_ctx_io_vector_period_get(cab_ctx_t *ctx)
+{
+    return ctx->vector_period;
+}
+
+cab_err_e
+cab_ctx_io_repeat(cab_ctx_t *ctx, unsigned n)
+{
+    cab_err_e err;
+
+    API_CALL(CAB_STATS_API_DELAY);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    if (n == 0) {
+        return CAB_ERR_NONE;
+    }
+
+    // The vector being repeated has to be in the batch first
+    if ((ctx->hold || !ctx->shadow_valid) &&
+      (err = commit(ctx, NULL)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    if ((err = batch_pad(ctx, n)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    return ctx->batch_depth == 0 && ctx->batch_nvectors > 0 ?
+      batch_flush(ctx, false) : CAB_ERR_NONE;
+}
+
+static void
+sleep_until(cab_ctx_t *ctx, uint64_t deadline)
+{
+    cab_trace_span_t span;
+    uint64_t start = stats_now();
+    struct timespec ts = {
+        deadline / 1000000000, deadline % 1000000000
+    };
+
+    if (deadline <= start) {
+        return;
+    }
+
+    span = cab_trace_begin("app", "sleep");
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    }
+
+    stats_sleep(&ctx->stats, stats_now() - start);
+    cab_trace_end_arg(&span, "us", (deadline - start) / 1000);
+}
+
+cab_err_e
+cab_ctx_delay_at_least(cab_ctx_t *ctx, unsigned long usec)
+{
+    uint64_t ns = usec * 1000ULL;
+    cab_err_e err;
+
+    API_CALL(CAB_STATS_API_DELAY);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    // Within a batch, the T48 can do the waiting, if we know how long it
+    // takes to apply a vector.
+    if (ctx->batch_depth > 0 && ctx->vector_period > 0 && ctx->shadow_valid) {
+        uint64_t n = (ns + ctx->vector_period - 1) / ctx->vector_period;
+
+        if (n <= DELAY_PAD_MAX) {
+            return batch_pad(ctx, n);
+        }
+    }
+
+    // Otherwise the delay runs from when the T48 acted on the last message,
+    // so anything queued has to go first.
+    if ((err = batch_flush(ctx, true)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    sleep_until(ctx, ctx->last_applied + ns);
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_io_hold_on(cab_ctx_t *ctx)
+{
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    ctx->hold = true;
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_io_hold_off(cab_ctx_t *ctx)
+{
+    API_CALL(CAB_STATS_API_HOLD_OFF);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    return commit(ctx, NULL);
+}
+
+cab_err_e
+cab_ctx_io_pin_modes(cab_ctx_t *ctx, uint8_t *pins, cab_pin_mode_e *modes,
+  int npins)
+{
+    API_CALL(CAB_STATS_API_PIN_MODE);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    for (int i = 0; i < npins; i++) {
+        if (pins[i] > T48_MAX_PINS) {
+            return CAB_ERR_OUT_OF_RANGE;
+        }
+    }
+
+    for (int i = 0; i < npins; i++) {
+        set_pin_mode(ctx, pins[i], modes[i]);
+    }
+
+    if (!ctx->hold) {
+        return commit(ctx, NULL);
+    }
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_io_pin_mode(cab_ctx_t *ctx, uint8_t pin, cab_pin_mode_e mode)
+{
+    API_CALL(CAB_STATS_API_PIN_MODE);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    if (pin > T48_MAX_PINS) {
+        return CAB_ERR_OUT_OF_RANGE;
+    }
+
+    set_pin_mode(ctx, pin, mode);
+
+    if (!ctx->hold) {
+        return commit(ctx, NULL);
+    }
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_io_read(cab_ctx_t *ctx, uint8_t *pins, uint8_t *values, int npins)
+{
+    API_CALL(CAB_STATS_API_READ);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    vector_read_t read = { pins, values, npins, NULL };
+
+    return commit(ctx, &read);
+}
+
+cab_err_e
+cab_ctx_io_set_and_read(cab_ctx_t *ctx, uint8_t *set_pins,
+  cab_pin_mode_e *modes, int nset, uint8_t *read_pins, uint8_t *values,
+  int nread)
+{
+    API_CALL(CAB_STATS_API_SET_AND_READ);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    if (nset > 0 && (set_pins == NULL || modes == NULL)) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    for (int i = 0; i < nset; i++) {
+        if (set_pins[i] > T48_MAX_PINS) {
+            return CAB_ERR_OUT_OF_RANGE;
+        }
+    }
+
+    for (int i = 0; i < nset; i++) {
+        set_pin_mode(ctx, set_pins[i], modes[i]);
+    }
+
+    vector_read_t read = { read_pins, values, nread, NULL };
+
+    return commit(ctx, &read);
+}
+
+cab_err_e
+cab_ctx_io_port_mode(cab_ctx_t *ctx, uint64_t mask, cab_pin_mode_e mode)
+{
+    API_CALL(CAB_STATS_API_PORT_MODE);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    if (mask >> T48_VECTOR_PINS) {
+        return CAB_ERR_OUT_OF_RANGE;
+    }
+
+    set_port_modes(ctx, mask, mode, NULL);
+
+    if (!ctx->hold) {
+        return commit(ctx, NULL);
+    }
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_io_port_write(cab_ctx_t *ctx, uint64_t mask, uint64_t values)
+{
+    API_CALL(CAB_STATS_API_PORT_WRITE);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    if (mask >> T48_VECTOR_PINS) {
+        return CAB_ERR_OUT_OF_RANGE;
+    }
+
+    set_port_modes(ctx, mask, CAB_PMODE_0, &values);
+
+    if (!ctx->hold) {
+        return commit(ctx, NULL);
+    }
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_io_port_read(cab_ctx_t *ctx, uint64_t *values)
+{
+    uint8_t raw[T48_VECTOR_BYTES];
+    vector_read_t read = { NULL, NULL, 0, raw };
+    cab_err_e err;
+
+    API_CALL(CAB_STATS_API_PORT_READ);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    if (values == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    // The result can't be deferred, since 'raw' is on the stack
+    if ((err = commit(ctx, &read)) != CAB_ERR_NONE || (ctx->batch_depth > 0 &&
+      (err = batch_flush(ctx, true)) != CAB_ERR_NONE)) {
+        return err;
+    }
+
+    *values = vector_to_port(raw);
+
+    return CAB_ERR_NONE;
+}
+
+unsigned long
+cab_ctx_io_commits_skipped(cab_ctx_t *ctx)
+{
+    return ctx->commits_skipped;
+}
+
+cab_err_e
+cab_ctx_io_read_async(cab_ctx_t *ctx, uint8_t *pins, int npins,
+  cab_ticket_t *ticket)
+{
+    API_CALL(CAB_STATS_API_READ_ASYNC);
+
+    if (ctx->device_never_reset) {
+        return CAB_ERR_STATE;
+    }
+
+    if (ticket == NULL || (npins > 0 && pins == NULL)) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if (npins < 0 || npins > T48_VECTOR_PINS) {
+        return CAB_ERR_OUT_OF_RANGE;
+    }
+
+    int chunk = ctx->ticket_count / TICKET_CHUNK;
+    if (chunk == ctx->ticket_nchunks) {
+        ticket_t **chunks = realloc(ctx->ticket_chunks,
+          (ctx->ticket_nchunks + 1) * sizeof *chunks);
+        if (chunks == NULL) {
+            return CAB_ERR_NO_MEMORY;
+        }
+        ctx->ticket_chunks = chunks;
+        chunks[chunk] = malloc(TICKET_CHUNK * sizeof (ticket_t));
+        if (chunks[chunk] == NULL) {
+            return CAB_ERR_NO_MEMORY;
+        }
+        ctx->ticket_nchunks++;
+    }
+
+    ticket_t *t = &ctx->ticket_chunks[chunk][ctx->ticket_count % TICKET_CHUNK];
+    if (npins > 0) {
+        memcpy(t->pins, pins, npins);
+    }
+    t->npins = npins;
+    t->ready = false;
+
+    vector_read_t read = { NULL, NULL, 0, t->raw, 0, &t->ready };
+
+    *ticket = ctx->ticket_count++;
+
+    return commit(ctx, &read);
+}
+
+cab_err_e
+cab_ctx_io_port_read_async(cab_ctx_t *ctx, cab_ticket_t *ticket)
+{
+    return cab_ctx_io_read_async(ctx, NULL, 0, ticket);
+}
+
+static cab_err_e
+ticket_wait(cab_ctx_t *ctx, cab_ticket_t ticket, ticket_t **tp)
+{
+    cab_err_e err;
+
+    if (ticket >= ctx->ticket_count) {
+        return CAB_ERR_OUT_OF_RANGE;
+    }
+
+    ticket_t *t =
+      &ctx->ticket_chunks[ticket / TICKET_CHUNK][ticket % TICKET_CHUNK];
+
+    if (!t->ready) {
+        if ((err = batch_flush(ctx, true)) != CAB_ERR_NONE) {
+            return err;
+        }
+        if (!t->ready) {
+            return CAB_ERR_STATE;
+        }
+    }
+
+    *tp = t;
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_io_collect(cab_ctx_t *ctx, cab_ticket_t ticket, uint8_t *values)
+{
+    ticket_t *t;
+    cab_err_e err;
+
+    API_CALL(CAB_STATS_API_COLLECT);
+
+    if ((err = ticket_wait(ctx, ticket, &t)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    if (t->npins > 0 && values == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    for (int i = 0; i < t->npins; i++) {
+        values[i] = vector_pin_value(t->raw, t->pins[i]);
+    }
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_io_port_collect(cab_ctx_t *ctx, cab_ticket_t ticket, uint64_t *values)
+{
+    ticket_t *t;
+    cab_err_e err;
+
+    API_CALL(CAB_STATS_API_COLLECT);
+
+    if (values == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if ((err = ticket_wait(ctx, ticket, &t)) != CAB_ERR_NONE) {
+        return err;
+    }
+
+    *values = vector_to_port(t->raw);
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_io_tickets_release(cab_ctx_t *ctx)
+{
+    cab_err_e err = CAB_ERR_NONE;
+
+    API_CALL(CAB_STATS_API_COLLECT);
+
+    if (ctx->ticket_count > 0) {
+        err = batch_flush(ctx, true);
+        ctx->ticket_count = 0;
+    }
+
+    return err;
+}
+
+// Contexts
+
+// Look up a transport by name, which may be followed by ":serial", in which
+// case the serial number is copied to 'serial'.
+static const cab_transport_ops_t *
+transport_lookup(const char *name, cab_serial_t serial)
+{
+    const char *colon;
+    size_t len;
+
+    if (name == NULL) {
+        return transports[0];
+    }
+
+    colon = strchr(name, ':');
+    len = colon ? colon - name : strlen(name);
+    if (colon) {
+        snprintf(serial, CAB_SERIAL_MAX, "%s", colon + 1);
+    }
+
+    for (int i = 0; i < sizeof transports / sizeof *transports; i++) {
+        if (strlen(transports[i]->name) == len &&
+          strncmp(name, transports[i]->name, len) == 0) {
+            return transports[i];
+        }
+    }
+
+    fprintf(stderr, "Unknown transport '%.*s'\n", (int)len, name);
+    return NULL;
+}
+
+// Give back everything the transport holds for the context, and close it
+static void
+ctx_close_transport(cab_ctx_t *ctx)
+{
+    const cab_transport_ops_t *ops = ctx->transport->ops;
+
+    if (ops->release != NULL) {
+        for (int i = 0; i < USB_QUEUE_MAX; i++) {
+            ops->release(ctx->transport, &ctx->usb_slots[i].xfer);
+        }
+    }
+    ops->close(ctx->transport);
+}
+
+static cab_err_e
+ctx_open(const char *name, const char *serial, bool verbose,
+  cab_ctx_t **ctxp)
+{
+    const char *period = getenv("CABBIC_VECTOR_NS");
+    const cab_transport_ops_t *ops;
+    cab_serial_t named = "";
+    cab_ctx_t *ctx;
+
+    if ((ops = transport_lookup(name, named)) == NULL) {
+        return CAB_ERR_INVALID_PARAM;
+    }
+    if (serial == NULL && named[0] != '\0') {
+        serial = named;
+    }
+
+    // The rings are aligned to cache lines, so the context must be too
+    if ((ctx = aligned_alloc(_Alignof(cab_ctx_t), sizeof *ctx)) == NULL) {
+        return CAB_ERR_NO_MEMORY;
+    }
+    memset(ctx, 0, sizeof *ctx);
+
+    ctx->device_never_reset = true;
+    ctx->usb_queue_depth = 1;
+    ctx->vector_period = period ? atol(period) : 0;
+    stats_reset(&ctx->stats);
+
+    // The programmer may have gone, or been taken by another process, since
+    // it was enumerated
+    if ((ctx->transport = ops->open(serial)) == NULL) {
+        free(ctx);
+        return CAB_ERR_IO;
+    }
+    init_t48(ctx, verbose);
+
+    // Transports which can't choose between T48s just open the one they have
+    if (serial && strcmp(serial, ctx->serial) != 0) {
+        fprintf(stderr, "T48 has serial number %s, not %s\n", ctx->serial,
+          serial);
+        ctx_close_transport(ctx);
+        free(ctx);
+        return CAB_ERR_STATE;
+    }
+
+    *ctxp = ctx;
+
+    return CAB_ERR_NONE;
+}
+
+cab_err_e
+cab_ctx_open(const char *transport, cab_ctx_t **ctx)
+{
+    return cab_ctx_open_serial(transport, NULL, ctx);
+}
+
+cab_err_e
+cab_ctx_open_serial(const char *transport, const char *serial,
+  cab_ctx_t **ctx)
+{
+    if (ctx == NULL) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if (transport == NULL) {
+        transport = getenv("CABBIC_TRANSPORT");
+    }
+
+    return ctx_open(transport, serial, false, ctx);
+}
+
+cab_err_e
+cab_enumerate(const char *transport, cab_serial_t *serials, int max,
+  int *count)
+{
+    const cab_transport_ops_t *ops;
+    cab_serial_t named;
+
+    if (count == NULL || (serials == NULL && max > 0)) {
+        return CAB_ERR_BAD_POINTER;
+    }
+
+    if (transport == NULL) {
+        transport = getenv("CABBIC_TRANSPORT");
+    }
+
+    if ((ops = transport_lookup(transport, named)) == NULL) {
+        return CAB_ERR_INVALID_PARAM;
+    }
+
+    if (ops->enumerate == NULL) {
+        return CAB_ERR_STATE;
+    }
+
+    *count = ops->enumerate(serials, max);
+
+    return CAB_ERR_NONE;
+}
+
+// Make sure anything left queued reaches the device, and stop the I/O thread
+static cab_err_e
+ctx_finish(cab_ctx_t *ctx)
+{
+    cab_err_e err;
+
+    stats_api_enter(&ctx->stats, CAB_STATS_API_CORE);
+    err = batch_flush(ctx, true);
+
+    if (ctx->io_thread) {
+        cab_ctx_io_thread_stop(ctx);
+    }
+
+    return err;
+}
+
+void
+cab_ctx_close(cab_ctx_t *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+
+    ctx_finish(ctx);
+    ctx_close_transport(ctx);
+
+    for (int i = 0; i < ctx->ticket_nchunks; i++) {
+        free(ctx->ticket_chunks[i]);
+    }
+    free(ctx->ticket_chunks);
+
+    if (ctx == default_ctx) {
+        default_ctx = NULL;
+    }
+    free(ctx);
+}
+
+cab_ctx_t *
+cab_ctx_default()
+{
+    return default_ctx;
+}
+
+const char *
+cab_ctx_serial(cab_ctx_t *ctx)
+{
+    return ctx->serial;
+}
+
+void
+cab_ctx_stats_get(cab_ctx_t *ctx, cab_stats_t *stats)
+{
+    stats_get(&ctx->stats, stats);
+}
+
+void
+cab_ctx_stats_reset(cab_ctx_t *ctx)
+{
+    stats_reset(&ctx->stats);
+}
+
+void
+cab_ctx_usleep(cab_ctx_t *ctx, unsigned long usec)
+{
+    cab_trace_span_t span = cab_trace_begin("app", "sleep");
+    uint64_t start = stats_now();
+
+    usleep(usec);
+
+    stats_sleep(&ctx->stats, stats_now() - start);
+    cab_trace_end_arg(&span, "us", usec);
+}
+
+// The original API, which acts on the default context
+
+cab_err_e
+cab_io_thread_start()
+{
+    return cab_ctx_io_thread_start(default_ctx);
+}
+
+cab_err_e
+cab_io_thread_stop()
+{
+    return cab_ctx_io_thread_stop(default_ctx);
+}
+
+cab_err_e
+cab_set_io_voltage(float voltage)
+{
+    return cab_ctx_set_io_voltage(default_ctx, voltage);
+}
+
+cab_err_e
+cab_reset(uint8_t *gnd_pins, int ngnd, uint8_t *vcc_pins, int nvcc,
+  uint8_t *vpp_pins, int nvpp, float vcc_voltage, float vpp_voltage)
+{
+    return cab_ctx_reset(default_ctx, gnd_pins, ngnd, vcc_pins, nvcc, vpp_pins,
+      nvpp, vcc_voltage, vpp_voltage);
+}
+
+cab_err_e
+cab_set_vpp_voltage(float voltage)
+{
+    return cab_ctx_set_vpp_voltage(default_ctx, voltage);
+}
+
+cab_err_e
+cab_io_pullup(bool enabled)
+{
+    return cab_ctx_io_pullup(default_ctx, enabled);
+}
+
+cab_err_e
+cab_io_batch_begin()
+{
+    return cab_ctx_io_batch_begin(default_ctx);
+}
+
+cab_err_e
+cab_io_batch_flush()
+{
+    return cab_ctx_io_batch_flush(default_ctx);
+}
+
+cab_err_e
+cab_set_queue_depth(int depth)
+{
+    return cab_ctx_set_queue_depth(default_ctx, depth);
+}
+
+cab_err_e
+cab_io_batch_end()
+{
+    return cab_ctx_io_batch_end(default_ctx);
+}
+
+cab_err_e
+cab_io_hold_on()
+{
+    return cab_ctx_io_hold_on(default_ctx);
+}
+
+cab_err_e
+cab_io_hold_off()
+{
+    return cab_ctx_io_hold_off(default_ctx);
+}
+
+cab_err_e
+cab_io_pin_modes(uint8_t *pins, cab_pin_mode_e *modes, int npins)
+{
+    return cab_ctx_io_pin_modes(default_ctx, pins, modes, npins);
+}
+
+cab_err_e
+cab_io_pin_mode(uint8_t pin, cab_pin_mode_e mode)
+{
+    return cab_ctx_io_pin_mode(default_ctx, pin, mode);
+}
+
+cab_err_e
+cab_io_read(uint8_t *pins, uint8_t *values, int npins)
+{
+    return cab_ctx_io_read(default_ctx, pins, values, npins);
+}
+
+cab_err_e
+cab_io_set_and_read(uint8_t *set_pins, cab_pin_mode_e *modes, int nset,
+  uint8_t *read_pins, uint8_t *values, int nread)
+{
+    return cab_ctx_io_set_and_read(default_ctx, set_pins, modes, nset,
+      read_pins, values, nread);
+}
+
+cab_err_e
+cab_io_port_mode(uint64_t mask, cab_pin_mode_e mode)
+{
+    return cab_ctx_io_port_mode(default_ctx, mask, mode);
+}
+
+cab_err_e
+cab_io_port_write(uint64_t mask, uint64_t values)
+{
+    return cab_ctx_io_port_write(default_ctx, mask, values);
+}
+
+cab_err_e
+cab_io_port_read(uint64_t *values)
+{
+    return cab_ctx_io_port_read(default_ctx, values);
+}
+
+unsigned long
+cab_io_commits_skipped()
+{
+    return cab_ctx_io_commits_skipped(default_ctx);
+}
+
+cab_err_e
+cab_io_read_async(uint8_t *pins, int npins, cab_ticket_t *ticket)
+{
+    return cab_ctx_io_read_async(default_ctx, pins, npins, ticket);
+}
+
+cab_err_e
+cab_io_port_read_async(cab_ticket_t *ticket)
+{
+    return cab_ctx_io_port_read_async(default_ctx, ticket);
+}
+
+cab_err_e
+cab_io_collect(cab_ticket_t ticket, uint8_t *values)
+{
+    return cab_ctx_io_collect(default_ctx, ticket, values);
+}
+
+cab_err_e
+cab_io_port_collect(cab_ticket_t ticket, uint64_t *values)
+{
+    return cab_ctx_io_port_collect(default_ctx, ticket, values);
+}
+
+cab_err_e
+cab_io_tickets_release()
+{
+    return cab_ctx_io_tickets_release(default_ctx);
+}
+
+void
+cab_stats_get(cab_stats_t *stats)
+{
+    cab_ctx_stats_get(default_ctx, stats);
+}
+
+void
+cab_stats_reset()
+{
+    cab_ctx_stats_reset(default_ctx);
+}
+
+void
+cab_usleep(unsigned long usec)
+{
+    cab_ctx_usleep(default_ctx, usec);
+}
+
+cab_err_e
+cab_delay_at_least(unsigned long usec)
+{
+    return cab_ctx_delay_at_least(default_ctx, usec);
+}
+
+cab_err_e
+cab_io_vector_period(unsigned long ns)
+{
+    return cab_ctx_io_vector_period(default_ctx, ns);
+}
+
+unsigned long
+cab_io_vector_period_get()
+{
+    return cab_ctx_io_vector_period_get(default_ctx);
+}
+
+cab_err_e
+cab_io_repeat(unsigned n)
+{
+    return cab_ctx_io_repeat(default_ctx, n);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *trace = getenv("CABBIC_TRACE");
+    int rc;
+
+    if (trace) {
+        trace_open(trace);
+    }
+
+    rc = ctx_open(getenv("CABBIC_TRANSPORT"), NULL, true, &default_ctx);
+    if (rc != CAB_ERR_NONE) {
+        fprintf(stderr, "%s\n", cab_sterror(rc));
+        return EXIT_FAILURE;
+    }
+
+    rc = app_run(argc, argv);
+
+    ctx_finish(default_ctx);
+
+    if (getenv("CABBIC_STATS")) {
+        cab_stats_t stats;
+        cab_ctx_stats_get(default_ctx, &stats);
+        cab_stats_print(&stats, stderr);
+    }
+
+    cab_ctx_close(default_ctx);
+    trace_close();
 
     printf("Application ");
     if (rc == CAB_ERR_NONE) {